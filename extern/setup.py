@@ -5,6 +5,9 @@ import os
 # Get the current directory
 this_dir = os.path.dirname(os.path.abspath(__file__))
 
+# NETWORK_IO_URING=1 builds on asio's io_uring backend (experimental), matching the CMake option of the same name
+use_io_uring = os.environ.get("NETWORK_IO_URING", "0") == "1"
+
 # Define the C++ extension module
 ext_modules = [
     Pybind11Extension(
@@ -15,8 +18,17 @@ ext_modules = [
             os.path.join(this_dir, "src", "network.cpp"),
             os.path.join(this_dir, "..", "tcp_connection.cpp"),
             os.path.join(this_dir, "..", "tcp_protocol.cpp"),
+            os.path.join(this_dir, "..", "tcp_dispatcher.cpp"),
+            os.path.join(this_dir, "..", "tcp_shm_transport.cpp"),
+            os.path.join(this_dir, "..", "tcp_codec.cpp"),
+            os.path.join(this_dir, "..", "tcp_shaper.cpp"),
+            os.path.join(this_dir, "..", "tcp_sim_transport.cpp"),
+            os.path.join(this_dir, "..", "tcp_subscription.cpp"),
+            os.path.join(this_dir, "..", "tcp_threads.cpp"),
         ],
         include_dirs=["/home/pgrams/asio-1.30.2/include"],
+        define_macros=[("ASIO_HAS_IO_URING", None), ("ASIO_DISABLE_EPOLL", None)] if use_io_uring else [],
+        libraries=["uring"] if use_io_uring else [],
         # Specify C++11 standard
         extra_compile_args=["-std=c++17"],
         language='c++'
@@ -30,6 +42,11 @@ setup(
     author="Your Name",
     description="Python bindings for pGRAMS Network bindings",
     ext_modules=ext_modules,
+    # asyncio wrapper around the compiled module
+    py_modules=["network_asyncio"],
+    package_dir={"": "src"},
+    # The batch receive calls return NumPy arrays
+    install_requires=["numpy"],
     # Use the custom build command from pybind11
     cmdclass={"build_ext": build_ext},
 )
@@ -3,13 +3,42 @@
 //
 
 #include <streambuf>
+#include <limits>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h> // Needed for automatic vector conversions
 #include <pybind11/iostream.h>
+#include <pybind11/numpy.h>
 #include "../../tcp_connection.h"
 
 namespace py = pybind11;
 
+// Hand the argument vector over to a NumPy array without copying. The vector is moved to the heap
+// and owned by a capsule, so the array shares the C++ memory and frees it when Python is done with it
+py::array_t<uint32_t> ArgumentsToArray(std::vector<uint32_t> &&args) {
+    auto *owned_args = new std::vector<uint32_t>(std::move(args));
+    py::capsule owner(owned_args, [](void *p) { delete static_cast<std::vector<uint32_t>*>(p); });
+    return py::array_t<uint32_t>(owned_args->size(), owned_args->data(), owner);
+}
+
+// Batch read results as a list of (command, uint32 array) tuples
+py::list CommandsToArrays(std::vector<Command> &commands) {
+    py::list cmd_list;
+    for (auto &cmd : commands) {
+        cmd_list.append(py::make_tuple(cmd.command, ArgumentsToArray(std::move(cmd.arguments))));
+    }
+    return cmd_list;
+}
+
+// Convert a Python timeout in seconds to the C++ timeout
+std::chrono::milliseconds ToTimeout(const double timeout) {
+    return std::chrono::milliseconds(static_cast<int64_t>(std::max(0.0, timeout) * 1000.));
+}
+
+// Simulated link times are given in seconds from Python
+SimLink::Duration ToSimDuration(const double seconds) {
+    return SimLink::Duration(static_cast<int64_t>(std::max(0.0, seconds) * 1e9));
+}
+
 class PythonStreamBuf : public std::streambuf {
 public:
     PythonStreamBuf(py::object py_stdout) : py_stdout_(py_stdout) {}
@@ -41,9 +70,18 @@ PYBIND11_MODULE(network_module, m) {
     py::class_<asio::io_context>(m, "IOContext")
         .def(py::init<>())
 //        .def("run", &asio::io_context::run)
-        .def("run", static_cast<std::size_t (asio::io_context::*)()>(&asio::io_context::run))
+        // Release the GIL so a single Python thread can run the context for any number of links
+        .def("run", static_cast<std::size_t (asio::io_context::*)()>(&asio::io_context::run),
+             py::call_guard<py::gil_scoped_release>())
         .def("stop", &asio::io_context::stop);
 
+    // Keeps IOContext.run() from returning while there is no pending work, reset() to let it finish
+    using WorkGuard = asio::executor_work_guard<asio::io_context::executor_type>;
+    py::class_<WorkGuard>(m, "WorkGuard")
+        .def(py::init([](asio::io_context &ctx) { return std::make_unique<WorkGuard>(ctx.get_executor()); }),
+             py::arg("io_context"), py::keep_alive<1, 2>())
+        .def("reset", &WorkGuard::reset);
+
     // Since the TCPProtocol class inherits the Command class we have to also bind it
     // 1. Bind the base class FIRST
     py::class_<Command, std::shared_ptr<Command>>(m, "Command")
@@ -73,8 +111,120 @@ PYBIND11_MODULE(network_module, m) {
         .def_property_readonly_static("kStartCode1", [](py::object /* self */) { return TCPProtocol::kStartCode1; })
         .def_property_readonly_static("kStartCode2", [](py::object /* self */) { return TCPProtocol::kStartCode2; })
         .def_property_readonly_static("kEndCode1", [](py::object /* self */) { return TCPProtocol::kEndCode1; })
-        .def_property_readonly_static("kEndCode2", [](py::object /* self */) { return TCPProtocol::kEndCode2; });
+        .def_property_readonly_static("kEndCode2", [](py::object /* self */) { return TCPProtocol::kEndCode2; })
+        .def_property_readonly_static("kCapCorrelation", [](py::object /* self */) { return TCPProtocol::kCapCorrelation; })
+        .def_property_readonly_static("kCapCompression", [](py::object /* self */) { return TCPProtocol::kCapCompression; })
+        .def_property_readonly_static("kCapFragmentation", [](py::object /* self */) { return TCPProtocol::kCapFragmentation; })
+        .def_property_readonly_static("kCapBatching", [](py::object /* self */) { return TCPProtocol::kCapBatching; });
 
+    // Handle for an outstanding request, resolves to the peer's ack Command
+    py::class_<std::future<Command>>(m, "RequestFuture")
+        .def("wait", [](const std::future<Command> &self, double timeout) {
+                 return self.wait_for(ToTimeout(timeout)) == std::future_status::ready;
+             },
+             py::arg("timeout"),
+             py::call_guard<py::gil_scoped_release>(),
+             "Wait at most timeout seconds for the ack, returns True once it has arrived")
+        .def("result", [](std::future<Command> &self) { return self.get(); },
+             py::call_guard<py::gil_scoped_release>(),
+             "Block until the ack arrives and return it, raises if the request failed or timed out");
+
+    // Loss and staleness counters of a UDP monitor link
+    py::class_<TCPConnection::DatagramStats>(m, "DatagramStats")
+        .def_readonly("received", &TCPConnection::DatagramStats::received)
+        .def_readonly("lost", &TCPConnection::DatagramStats::lost)
+        .def_readonly("out_of_order", &TCPConnection::DatagramStats::out_of_order)
+        .def_readonly("corrupt", &TCPConnection::DatagramStats::corrupt)
+        .def_property_readonly("age", [](const TCPConnection::DatagramStats &self) {
+                 // Seconds since the last good datagram, inf if none has arrived
+                 if (self.age == std::chrono::milliseconds::max()) return std::numeric_limits<double>::infinity();
+                 return std::chrono::duration<double>(self.age).count();
+             });
+
+    py::class_<TCPConnection::ShapingStats>(m, "ShapingStats")
+        .def_readonly("frames", &TCPConnection::ShapingStats::frames)
+        .def_readonly("delayed", &TCPConnection::ShapingStats::delayed)
+        .def_readonly("mean_delay_ms", &TCPConnection::ShapingStats::mean_delay_ms)
+        .def_readonly("max_delay_ms", &TCPConnection::ShapingStats::max_delay_ms)
+        .def_readonly("queued", &TCPConnection::ShapingStats::queued);
+
+    // Thread placement and CPU time of the library's threads, see ThreadControl
+    py::class_<ThreadControl::Stats>(m, "ThreadStats")
+        .def_readonly("name", &ThreadControl::Stats::name)
+        .def_readonly("threads", &ThreadControl::Stats::threads)
+        .def_readonly("cpu_seconds", &ThreadControl::Stats::cpu_seconds)
+        .def_readonly("voluntary_switches", &ThreadControl::Stats::voluntary_switches)
+        .def_readonly("involuntary_switches", &ThreadControl::Stats::involuntary_switches);
+
+    py::class_<ThreadControl>(m, "ThreadControl")
+        .def_static("configure", [](const std::string &name, std::vector<int> cpus, int fifo_priority) {
+                        ThreadControl::Configure(name, {std::move(cpus), fifo_priority});
+                    },
+                    py::arg("name"), py::arg("cpus") = std::vector<int>{}, py::arg("fifo_priority") = 0,
+                    "Pin the threads of a role (\"io\", \"send\", \"recv\", \"heartbeat\") or name (eg. \"send:50000\") "
+                    "to cpus and run them SCHED_FIFO if fifo_priority is 1-99. Call before starting the links")
+        .def_static("lock_memory", &ThreadControl::LockMemory,
+                    "Lock the process' memory so page faults can't stall real time threads, False if not permitted")
+        .def_static("get_stats", &ThreadControl::GetStats, "CPU time and context switches by thread name");
+
+    // In-process link with impairments on a virtual clock, shared by the ends of "sim:<name>" connections
+    py::class_<SimLink::Stats>(m, "SimLinkStats")
+        .def_readonly("frames", &SimLink::Stats::frames)
+        .def_readonly("bytes", &SimLink::Stats::bytes)
+        .def_readonly("corrupted", &SimLink::Stats::corrupted)
+        .def_readonly("truncated", &SimLink::Stats::truncated)
+        .def_readonly("lost", &SimLink::Stats::lost)
+        .def_readonly("disconnects", &SimLink::Stats::disconnects)
+        .def_readonly("closed", &SimLink::Stats::closed);
+
+    py::class_<SimLink, std::shared_ptr<SimLink>> sim_link(m, "SimLink");
+    py::enum_<SimLink::Direction>(sim_link, "Direction")
+        .value("kToServer", SimLink::kToServer)
+        .value("kToClient", SimLink::kToClient);
+    sim_link
+        .def_static("open", &SimLink::Open, py::arg("name"),
+                    "The link \"<name>.<port>\" used by connections to \"sim:<name>\", configure it before starting them")
+        .def("set_impairments", [](SimLink &self, SimLink::Direction direction, double latency, double jitter,
+                                   double bytes_per_sec, double bit_error_rate, double truncate_rate, double loss_rate) {
+                 self.SetImpairments(direction, {ToSimDuration(latency), ToSimDuration(jitter), bytes_per_sec,
+                                                 bit_error_rate, truncate_rate, loss_rate});
+             },
+             py::arg("direction"), py::arg("latency") = 0., py::arg("jitter") = 0., py::arg("bytes_per_sec") = 0.,
+             py::arg("bit_error_rate") = 0., py::arg("truncate_rate") = 0., py::arg("loss_rate") = 0.,
+             "Times in seconds, bytes_per_sec 0 is unlimited")
+        .def("set_seed", &SimLink::SetSeed, py::arg("seed"))
+        .def("schedule_disconnect", [](SimLink &self, double at, double duration) {
+                 self.ScheduleDisconnect(ToSimDuration(at), ToSimDuration(duration));
+             },
+             py::arg("at"), py::arg("duration"), "Drop the link at virtual time at for duration seconds")
+        .def("now", [](const SimLink &self) { return std::chrono::duration<double>(self.Now()).count(); },
+             "Virtual time in seconds")
+        .def("advance", [](SimLink &self, double duration) { self.Advance(ToSimDuration(duration)); },
+             py::arg("duration"), py::call_guard<py::gil_scoped_release>(),
+             "Run both ends for duration seconds of virtual time")
+        .def("get_stats", &SimLink::GetStats);
+
+    // A consumer's own queue of received commands, see TCPConnection.subscribe()
+    py::class_<Subscription, std::shared_ptr<Subscription>>(m, "Subscription")
+        .def("read", [](Subscription &self, double timeout) -> std::optional<Command> {
+                 Subscription::Ptr cmd;
+                 {
+                     py::gil_scoped_release release;
+                     cmd = self.Read(ToTimeout(timeout));
+                 }
+                 if (!cmd) return std::nullopt;
+                 return *cmd;
+             },
+             py::arg("timeout"),
+             "Next Command, waiting at most timeout seconds, None if none arrived or the subscription is closed")
+        .def("try_read", [](Subscription &self) -> std::optional<Command> {
+                 Subscription::Ptr cmd = self.TryRead();
+                 if (!cmd) return std::nullopt;
+                 return *cmd;
+             })
+        .def("size", &Subscription::Size)
+        .def("get_dropped", &Subscription::GetDropped, "Commands dropped because the queue was full")
+        .def("close", &Subscription::Close);
 
     py::class_<TCPConnection, std::shared_ptr<TCPConnection>, Command>(m, "TCPConnection")
         .def(py::init<asio::io_context&, const std::string&, uint16_t, bool, bool, bool>(),
@@ -83,15 +233,66 @@ PYBIND11_MODULE(network_module, m) {
              py::arg("port"),
              py::arg("is_server"),
              py::arg("use_heartbeat"),
-             py::arg("monitor_link"))
+             py::arg("monitor_link"),
+             "ip_address may be \"unix:<path>\" (or \"unix:@<name>\" for the abstract namespace) to "
+             "connect over a unix domain socket at <path>.<port> instead of TCP, \"shm:<name>\" for shared "
+             "memory, \"udp:<ip>\" for a datagram monitor link or \"sim:<name>\" for a simulated link, see SimLink")
 
         // WriteSendBuffer(uint16_t, std::vector<uint32_t>&)
-        .def("write_send_buffer", [](TCPConnection &self, uint16_t cmd, const std::vector<uint32_t> &vec) {
-                 // copy is fine since Python -> C++ conversion yields a temporary anyway
-                 std::vector<uint32_t> copy = vec;
-                 self.WriteSendBuffer(cmd, copy);
+        .def("write_send_buffer", [](TCPConnection &self, uint16_t cmd, std::vector<uint32_t> vec) {
+                 // The Python -> C++ conversion yields a temporary so it can be moved straight into the queue
+                 self.WriteSendBuffer(cmd, vec);
              },
              py::arg("cmd"), py::arg("args"))
+        .def("write_send_buffer", [](TCPConnection &self, uint16_t cmd, std::vector<uint32_t> vec, double max_age) {
+                 Command cmd_packet(cmd, 0);
+                 cmd_packet.arguments = std::move(vec);
+                 self.WriteSendBuffer(std::move(cmd_packet), std::chrono::steady_clock::now() + ToTimeout(max_age));
+             },
+             py::arg("cmd"), py::arg("args"), py::arg("max_age"),
+             "Queue a command which is dropped instead of sent if it waits more than max_age seconds")
+
+        // Bulk send from contiguous arrays: command i has code codes[i] and arguments
+        // args[offsets[i]:offsets[i+1]], so offsets has one more entry than codes
+        .def("write_send_buffer_batch",
+             [](TCPConnection &self,
+                const py::array_t<uint16_t, py::array::c_style | py::array::forcecast> &codes,
+                const py::array_t<int64_t, py::array::c_style | py::array::forcecast> &offsets,
+                const py::array_t<uint32_t, py::array::c_style | py::array::forcecast> &args) {
+                 const auto num_cmds = static_cast<size_t>(codes.size());
+                 const auto num_words = static_cast<int64_t>(args.size());
+                 if (codes.ndim() != 1 || offsets.ndim() != 1 || args.ndim() != 1) {
+                     throw std::invalid_argument("codes, offsets and args must be 1D arrays");
+                 }
+                 if (static_cast<size_t>(offsets.size()) != num_cmds + 1) {
+                     throw std::invalid_argument("offsets must have len(codes) + 1 entries");
+                 }
+                 const uint16_t *p_codes = codes.data();
+                 const int64_t *p_offsets = offsets.data();
+                 const uint32_t *p_args = args.data();
+                 for (size_t i = 0; i < num_cmds; i++) {
+                     if (p_offsets[i] < 0 || p_offsets[i] > p_offsets[i + 1] || p_offsets[i + 1] > num_words ||
+                         p_offsets[i + 1] - p_offsets[i] > static_cast<int64_t>(TCPProtocol::kMaxMessageArgs)) {
+                         throw std::invalid_argument("offsets must be increasing, within args and at most "
+                                                     + std::to_string(TCPProtocol::kMaxMessageArgs) + " words apart");
+                     }
+                 }
+                 // The arrays are kept alive by the arguments, so the GIL is not needed to read them
+                 py::gil_scoped_release release;
+                 std::vector<Command> cmds;
+                 cmds.reserve(num_cmds);
+                 for (size_t i = 0; i < num_cmds; i++) {
+                     const uint32_t *first = p_args + p_offsets[i];
+                     cmds.emplace_back(p_codes[i], 0);
+                     cmds.back().arguments.assign(first, p_args + p_offsets[i + 1]);
+                 }
+                 self.WriteSendBuffer(cmds);
+                 return num_cmds;
+             },
+             py::arg("codes"), py::arg("offsets"), py::arg("args"),
+             "Queue many commands in one call from NumPy arrays of command codes, argument offsets "
+             "and the flattened uint32 argument words. Commands over 65535 words are fragmented like "
+             "write_send_buffer, which needs the peer to support fragmentation. Returns the number of commands queued")
 
         // WriteSendBuffer(const Command&)
         .def("write_send_buffer", [](TCPConnection &self, const Command &cmd) {
@@ -100,10 +301,12 @@ PYBIND11_MODULE(network_module, m) {
              py::arg("command"))
 
         // Overload: ReadRecvBuffer() -> Command
+        // The blocking reads release the GIL so other Python threads keep running while we wait
         .def("read_recv_buffer",
              [](TCPConnection &self) {
                  return self.ReadRecvBuffer();
              },
+             py::call_guard<py::gil_scoped_release>(),
              "Read one Command from the receive buffer")
 
         // Overload: ReadRecvBuffer(size_t num_cmds) -> std::vector<Command>
@@ -112,8 +315,125 @@ PYBIND11_MODULE(network_module, m) {
                  return self.ReadRecvBuffer(num_cmds);
              },
              py::arg("num_cmds"),
+             py::call_guard<py::gil_scoped_release>(),
              "Read multiple Commands from the receive buffer")
 
+        // ReadRecvBuffer(Command&, timeout) -> Command or None if the timeout expired
+        .def("read_recv_buffer_wait",
+             [](TCPConnection &self, double timeout) -> std::optional<Command> {
+                 Command cmd(0, 0);
+                 bool cmd_read;
+                 {
+                     py::gil_scoped_release release;
+                     cmd_read = self.ReadRecvBuffer(cmd, ToTimeout(timeout));
+                 }
+                 if (!cmd_read) return std::nullopt;
+                 return cmd;
+             },
+             py::arg("timeout"),
+             "Read one Command, waiting at most timeout seconds. Returns None on timeout")
+
+        // Batch read returning (command, uint32 array) tuples, the arrays share memory with the C++ buffers
+        .def("read_recv_arrays",
+             [](TCPConnection &self, size_t num_cmds, double timeout) {
+                 std::vector<Command> commands;
+                 {
+                     py::gil_scoped_release release;
+                     commands = self.ReadRecvBuffer(num_cmds, ToTimeout(timeout));
+                 }
+                 return CommandsToArrays(commands);
+             },
+             py::arg("num_cmds"), py::arg("timeout") = 1.0,
+             "Read up to num_cmds Commands as (command, numpy.uint32 array) tuples, "
+             "waiting at most timeout seconds for the first one")
+
+        // Non-blocking batch reads, return immediately with whatever is in the receive buffer
+        .def("try_read_recv_buffer", &TCPConnection::TryReadRecvBuffer,
+             py::arg("num_cmds"),
+             py::call_guard<py::gil_scoped_release>(),
+             "Read up to num_cmds Commands without blocking")
+
+        .def("try_read_recv_arrays",
+             [](TCPConnection &self, size_t num_cmds) {
+                 std::vector<Command> commands;
+                 {
+                     py::gil_scoped_release release;
+                     commands = self.TryReadRecvBuffer(num_cmds);
+                 }
+                 return CommandsToArrays(commands);
+             },
+             py::arg("num_cmds"),
+             "Read up to num_cmds Commands as (command, numpy.uint32 array) tuples without blocking")
+
+        // Pipelined requests, many can be outstanding at once
+        .def("send_request",
+             [](TCPConnection &self, uint16_t cmd, std::vector<uint32_t> args, double timeout) {
+                 Command request(cmd, 0);
+                 request.arguments = std::move(args);
+                 return self.SendRequest(std::move(request), ToTimeout(timeout));
+             },
+             py::arg("cmd"), py::arg("args"), py::arg("timeout") = 0.0,
+             "Send a command and return a RequestFuture for the peer's ack. "
+             "timeout is in seconds, 0 waits forever")
+
+        .def("set_capabilities", &TCPConnection::SetCapabilities, py::arg("capabilities"),
+             "Opt in to protocol extensions (TCPProtocol.kCap* bits), call before starting the link")
+        .def("get_peer_capabilities", &TCPConnection::GetPeerCapabilities)
+        .def("enable_compression", &TCPConnection::EnableCompression, py::arg("cmd"),
+             "Delta compress frames of cmd once both ends have TCPProtocol.kCapCompression, call before starting the link")
+        .def("enable_latest_value", &TCPConnection::EnableLatestValue, py::arg("cmd"), py::arg("max_args"),
+             "Keep only the newest frame of cmd instead of queueing it, call before starting the link")
+        .def("read_latest", [](const TCPConnection &self, const uint16_t cmd) -> py::object {
+                 Command latest(cmd, 0);
+                 const uint64_t count = self.ReadLatest(cmd, latest);
+                 if (count == 0) return py::none();
+                 return py::make_tuple(count, ArgumentsToArray(std::move(latest.arguments)));
+             },
+             py::arg("cmd"),
+             "Newest frame of cmd as (frames received so far, numpy.uint32 array), None if none has arrived")
+        .def("get_datagram_stats", &TCPConnection::GetDatagramStats,
+             "Received, lost, out of order and corrupt datagram counts and the age of the latest, for udp: links")
+        .def("set_zero_copy", &TCPConnection::SetZeroCopy, py::arg("min_bytes"),
+             "Send frames of at least min_bytes with MSG_ZEROCOPY, 0 disables. Call before starting the link")
+        .def("set_max_queue_age", [](TCPConnection &self, uint16_t cmd, double max_age) {
+                 self.SetMaxQueueAge(cmd, ToTimeout(max_age));
+             },
+             py::arg("cmd"), py::arg("max_age"),
+             "Drop commands of cmd which waited more than max_age seconds to be sent, 0 disables. Call before starting the link")
+        .def("get_expired_counts", &TCPConnection::GetExpiredCounts,
+             "Commands dropped at their expiry so far, as a dict by command code")
+        .def("enable_conflation", &TCPConnection::EnableConflation, py::arg("cmd"),
+             "Replace an unsent command of cmd in the send queue with the newer one, call before starting the link")
+        .def("get_conflated_counts", &TCPConnection::GetConflatedCounts,
+             "Commands replaced before being sent so far, as a dict by command code")
+        .def("subscribe", [](TCPConnection &self, uint16_t first, uint16_t last, size_t capacity) {
+                 return self.Subscribe(first, last, capacity);
+             },
+             py::arg("first"), py::arg("last"), py::arg("capacity") = TCPConnection::kSubscriptionCapacity,
+             "Queue the received codes in [first, last] for this subscriber instead of the receive buffer. "
+             "Call before starting the link")
+        .def("add_failover_endpoint", &TCPConnection::AddFailoverEndpoint, py::arg("address"), py::arg("port"),
+             "Client links fail over to the endpoints added here, kept connected as a standby. Call before starting the link")
+        .def("get_active_endpoint", &TCPConnection::GetActiveEndpoint,
+             "Index of the endpoint in use, 0 for the one the connection was created with")
+        .def("get_failover_count", &TCPConnection::GetFailoverCount)
+        .def_static("broadcast", &TCPConnection::Broadcast, py::arg("cmd"), py::arg("connections"),
+                    py::call_guard<py::gil_scoped_release>(),
+                    "Queue cmd on each of the connections, serialized once into a frame they all share")
+        .def("set_traffic_class", &TCPConnection::SetTrafficClass, py::arg("cmd"), py::arg("traffic_class"),
+             "Put cmd in a traffic class (0-7, lower is released first) for shaping, call before starting the link")
+        .def("set_link_rate", &TCPConnection::SetLinkRate, py::arg("bytes_per_sec"), py::arg("burst_bytes"),
+             "Token bucket limit on everything sent on the link, 0 bytes/s removes it. May change while the link runs")
+        .def("set_class_rate", &TCPConnection::SetClassRate, py::arg("traffic_class"), py::arg("bytes_per_sec"), py::arg("burst_bytes"),
+             "Token bucket limit on one traffic class, 0 bytes/s removes it. May change while the link runs")
+        .def("get_shaping_stats", &TCPConnection::GetShapingStats, py::arg("traffic_class"),
+             "Frames sent in the class, how many were held back for tokens and for how long, and how many wait now. "
+             "Class 8 is the heartbeats and capabilities, which are never held back")
+
+        // Readiness descriptor for select/poll or asyncio's loop.add_reader
+        .def("recv_notify_fd", &TCPConnection::GetRecvNotifyFd,
+             "File descriptor which polls readable while Commands are waiting in the receive buffer")
+
         // DecodeRawPacket
     .def("get_socket_is_open", &TCPConnection::getSocketIsOpen)
 
@@ -123,6 +443,9 @@ PYBIND11_MODULE(network_module, m) {
         // control read loop
         .def("set_stop_cmd_read", &TCPConnection::setStopCmdRead)
 
+        // Start the link without spawning an io thread, so many links can share one IOContext thread
+        .def("start", &TCPConnection::Start)
+
         .def("run_ctx", [](TCPConnection &self, asio::io_context &ctx) {
             self.PythonRun(ctx);
         })
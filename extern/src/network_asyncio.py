@@ -0,0 +1,104 @@
+#
+# asyncio wrapper for network_module.TCPConnection
+#
+# The connection exposes an eventfd which polls readable while commands are waiting in the
+# receive buffer. Registering it with the event loop lets a single loop serve many links
+# without a thread per link or sleep based polling.
+#
+#   ctx = network_module.IOContext()
+#   io_thread = IOContextThread(ctx)
+#   conn = network_module.TCPConnection(ctx, "127.0.0.1", 50003, True, False, True)
+#   conn.start()
+#   io_thread.start()
+#
+#   link = AsyncConnection(conn)
+#   async for cmd in link:
+#       print(cmd.command, cmd.arguments)
+#
+
+import asyncio
+import collections
+import threading
+
+import numpy as np
+
+import network_module
+
+
+class IOContextThread:
+    """Run one IOContext on a single background thread, shared by every link created on it."""
+
+    def __init__(self, io_context):
+        self.io_context = io_context
+        self._work_guard = network_module.WorkGuard(io_context)
+        self._thread = threading.Thread(target=io_context.run, name="network_io", daemon=True)
+
+    def start(self):
+        self._thread.start()
+
+    def stop(self):
+        self._work_guard.reset()
+        self.io_context.stop()
+        self._thread.join()
+
+
+class AsyncConnection:
+    """Awaitable receive interface for a TCPConnection.
+
+    Commands are drained from the C++ receive buffer in batches of up to batch_size with the
+    non-blocking try_read calls, so the loop is only woken when the receive buffer is non-empty.
+    """
+
+    def __init__(self, connection, batch_size=256):
+        self.connection = connection
+        self.batch_size = batch_size
+        self._notify_fd = connection.recv_notify_fd()
+        self._pending = collections.deque()
+
+    async def recv(self):
+        """Wait for the next Command."""
+        while not self._pending:
+            self._pending.extend(self.connection.try_read_recv_buffer(self.batch_size))
+            if not self._pending:
+                await self._wait_readable()
+        return self._pending.popleft()
+
+    async def recv_arrays(self, num_cmds=None):
+        """Wait for at least one command, then return up to num_cmds (command, numpy.uint32 array) tuples."""
+        num_cmds = self.batch_size if num_cmds is None else num_cmds
+        while True:
+            # Hand back anything already pulled by recv() first so ordering is preserved
+            if self._pending:
+                count = min(num_cmds, len(self._pending))
+                return [(cmd.command, np.asarray(cmd.arguments, dtype=np.uint32)) for cmd in
+                        (self._pending.popleft() for _ in range(count))]
+            commands = self.connection.try_read_recv_arrays(num_cmds)
+            if commands:
+                return commands
+            await self._wait_readable()
+
+    def send(self, cmd, args):
+        """Queue a command, this never blocks since the C++ side only enqueues it."""
+        self.connection.write_send_buffer(cmd, args)
+
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self):
+        return await self.recv()
+
+    async def _wait_readable(self):
+        # The fd is level triggered so only watch it while someone is waiting on it,
+        # otherwise the loop would keep firing the callback until the buffer is drained
+        loop = asyncio.get_running_loop()
+        ready = loop.create_future()
+
+        def on_readable():
+            if not ready.done():
+                ready.set_result(None)
+
+        loop.add_reader(self._notify_fd, on_readable)
+        try:
+            await ready
+        finally:
+            loop.remove_reader(self._notify_fd)
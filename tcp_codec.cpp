@@ -0,0 +1,125 @@
+//
+// Delta compression for repetitive status frames.
+//
+
+#include "tcp_codec.h"
+
+namespace {
+
+// Words past the end of a shorter reference frame are coded against 0
+inline uint32_t ReferenceWord(const std::vector<uint32_t> &reference, const size_t i) {
+    return i < reference.size() ? reference[i] : 0;
+}
+
+inline uint32_t ZigZag(const uint32_t delta) {
+    return (delta << 1) ^ static_cast<uint32_t>(static_cast<int32_t>(delta) >> 31);
+}
+
+inline uint32_t UnZigZag(const uint32_t value) {
+    return (value >> 1) ^ (0u - (value & 1));
+}
+
+inline void PutVarint(std::vector<uint8_t> &bytes, uint64_t value) {
+    while (value >= 0x80) {
+        bytes.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    bytes.push_back(static_cast<uint8_t>(value));
+}
+
+// Returns false if the varint runs past the end or is longer than a token can be
+inline bool GetVarint(const std::vector<uint8_t> &bytes, size_t &pos, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < bytes.size(); shift += 7) {
+        const uint8_t byte = bytes[pos++];
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+} // namespace
+
+void DeltaCodec::Encode(Command &cmd) {
+    std::vector<uint32_t> &reference = references_[cmd.command];
+    const std::vector<uint32_t> &args = cmd.arguments;
+    const size_t literal_bytes = args.size() * sizeof(uint32_t);
+
+    // Tokens are (changed word zigzag delta << 1) or (unchanged run length << 1 | 1)
+    bytes_.clear();
+    size_t i = 0;
+    while (i < args.size() && bytes_.size() < literal_bytes) {
+        const uint32_t delta = ZigZag(args[i] - ReferenceWord(reference, i));
+        if (delta != 0) {
+            PutVarint(bytes_, static_cast<uint64_t>(delta) << 1);
+            i++;
+            continue;
+        }
+        size_t run = 1;
+        while (i + run < args.size() && args[i + run] == ReferenceWord(reference, i + run)) run++;
+        PutVarint(bytes_, (static_cast<uint64_t>(run) << 1) | 1);
+        i += run;
+    }
+    const bool delta_mode = bytes_.size() < literal_bytes;
+
+    Command envelope(TCPProtocol::kCompressed, kEnvelopeWords);
+    envelope.arguments[0] = cmd.command | ((delta_mode ? kDelta : kLiteral) << 16);
+    envelope.arguments[1] = static_cast<uint32_t>(args.size());
+    if (delta_mode) {
+        envelope.arguments[2] = static_cast<uint32_t>(bytes_.size());
+        envelope.arguments.resize(kEnvelopeWords + (bytes_.size() + 3) / 4, 0);
+        for (size_t b = 0; b < bytes_.size(); b++) {
+            envelope.arguments[kEnvelopeWords + b / 4] |= static_cast<uint32_t>(bytes_[b]) << (24 - 8 * (b % 4));
+        }
+    } else {
+        envelope.arguments[2] = static_cast<uint32_t>(literal_bytes);
+        envelope.arguments.insert(envelope.arguments.end(), args.begin(), args.end());
+    }
+    // The caller is done with the plain arguments, they become the reference for the next frame
+    reference = std::move(cmd.arguments);
+    cmd = std::move(envelope);
+}
+
+bool DeltaCodec::Decode(Command &cmd) {
+    if (cmd.command != TCPProtocol::kCompressed || cmd.arguments.size() < kEnvelopeWords) return false;
+    const std::vector<uint32_t> &args = cmd.arguments;
+    const auto command = static_cast<uint16_t>(args[0] & 0xFFFF);
+    const uint32_t mode = args[0] >> 16;
+    const uint32_t arg_count = args[1];
+    const uint32_t num_bytes = args[2];
+    if (arg_count > TCPProtocol::kMaxMessageArgs || num_bytes > (args.size() - kEnvelopeWords) * sizeof(uint32_t)) return false;
+
+    std::vector<uint32_t> &reference = references_[command];
+    std::vector<uint32_t> words(arg_count);
+    if (mode == kLiteral) {
+        if (num_bytes != arg_count * sizeof(uint32_t)) return false;
+        std::copy(args.begin() + kEnvelopeWords, args.begin() + kEnvelopeWords + arg_count, words.begin());
+    } else if (mode == kDelta) {
+        bytes_.resize(num_bytes);
+        for (size_t b = 0; b < num_bytes; b++) {
+            bytes_[b] = static_cast<uint8_t>(args[kEnvelopeWords + b / 4] >> (24 - 8 * (b % 4)));
+        }
+        size_t pos = 0;
+        size_t i = 0;
+        uint64_t token = 0;
+        while (i < arg_count) {
+            if (!GetVarint(bytes_, pos, token)) return false;
+            if (token & 1) {
+                const uint64_t run = token >> 1;
+                if (run == 0 || run > arg_count - i) return false;
+                for (const size_t end = i + run; i < end; i++) words[i] = ReferenceWord(reference, i);
+            } else {
+                if ((token >> 1) > UINT32_MAX) return false;
+                words[i] = ReferenceWord(reference, i) + UnZigZag(static_cast<uint32_t>(token >> 1));
+                i++;
+            }
+        }
+        if (pos != num_bytes) return false;
+    } else {
+        return false;
+    }
+    reference = words;
+    cmd.command = command;
+    cmd.arguments = std::move(words);
+    return true;
+}
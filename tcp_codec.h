@@ -0,0 +1,42 @@
+//
+// Delta compression for repetitive status frames.
+//
+
+#ifndef TCP_CODEC_H
+#define TCP_CODEC_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "tcp_protocol.h"
+
+// Codes each frame against the previous frame with the same command code. The difference of each
+// word is zigzag coded so small changes either way stay small, then written as a varint, with runs
+// of unchanged words collapsed into a single run length. Status words which barely change between
+// periods shrink to about a byte each and unchanged stretches to almost nothing.
+//
+// The frames travel in a TCPProtocol::kCompressed envelope:
+//   [command | mode << 16, arg count, encoded byte count, encoded bytes packed 4 per word (MSB first)...]
+// Both ends must see every frame in order to keep their reference frames in step, so this is only
+// used on reliable links and each end resets its codec when the link (re)connects.
+class DeltaCodec {
+public:
+    // Replace cmd with its kCompressed envelope. Frames which don't delta code smaller than the plain
+    // words are stored as is, which costs the 3 word envelope but keeps both references in step
+    void Encode(Command &cmd);
+    // Restore the original command from a kCompressed envelope in place, false if it is malformed
+    bool Decode(Command &cmd);
+    void Reset() { references_.clear(); }
+    constexpr static size_t kEnvelopeWords = 3;
+
+private:
+    enum Mode : uint32_t {
+        kLiteral = 0,
+        kDelta = 1
+    };
+
+    std::unordered_map<uint16_t, std::vector<uint32_t>> references_;
+    std::vector<uint8_t> bytes_; // scratch space for the varint stream
+};
+
+#endif // TCP_CODEC_H
@@ -1,10 +1,18 @@
 #include "tcp_connection.h"
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
 
 TCPConnection::TCPConnection(asio::io_context& io_context, const std::string& ip_address,
     const uint16_t port, const bool is_server, const bool use_heartbeat, const bool monitor_link)
     : Command(0,0),
       tcp_protocol_(0,0),
-      endpoint_(asio::ip::make_address(ip_address), port),
+      endpoint_(MakeEndpoint(ip_address, port)),
       socket_(io_context),
       port_(port),
       client_connected_(false),
@@ -21,7 +29,11 @@ TCPConnection::TCPConnection(asio::io_context& io_context, const std::string& ip
       received_bytes_(0),
       heartbeat_count_(0),
       timer_(io_context),
-      recv_command_(0,0) {
+      recv_command_(0,0),
+      shaping_timer_(io_context),
+      standby_timer_(io_context),
+      reconnect_timer_(io_context),
+      send_stop_timer_(io_context) {
 
     // Make sure the decoder is ready for the first packet
     requested_bytes_ = sizeof(TCPProtocol::Header);
@@ -29,11 +41,32 @@ TCPConnection::TCPConnection(asio::io_context& io_context, const std::string& ip
     send_command_buffer_.clear();
     recv_command_buffer_.clear();
     recv_command_.arguments.reserve(100); // reserve a vector size so we don't have to keep allocating more memory
+    endpoints_.push_back(endpoint_);
+    const std::string shm_prefix = "shm:";
+    const std::string udp_prefix = "udp:";
+    const std::string sim_prefix = "sim:";
+    if (ip_address.compare(0, shm_prefix.size(), shm_prefix) == 0) {
+        shm_name_ = "/" + ip_address.substr(shm_prefix.size()) + "." + std::to_string(port);
+    } else if (ip_address.compare(0, sim_prefix.size(), sim_prefix) == 0) {
+        sim_ = SimLink::Open(ip_address.substr(sim_prefix.size()) + "." + std::to_string(port));
+    } else if (ip_address.compare(0, udp_prefix.size(), udp_prefix) == 0) {
+        // Commands and requests need every frame delivered, only the status snapshots can be lost
+        if (!monitor_link_) throw std::invalid_argument("udp: addresses are only supported on monitor links");
+        udp_endpoint_ = asio::ip::udp::endpoint(asio::ip::make_address(ip_address.substr(udp_prefix.size())), port);
+        udp_socket_.emplace(io_context);
+        datagram_buffer_.resize(0xFFFF); // largest UDP payload
+    }
     if (is_server_) {
         std::cout << "Starting Server on Address [" << ip_address << "] Port [" << port<< "]" << std::endl;
+        if (!shm_name_.empty() || sim_ || udp_socket_) return; // no acceptor, the segment or udp socket is set up by Start()
         if (debug_flag_) std::cout << "PRE Acceptor/accept socket value = " << acceptor_.has_value() << " / "
                                     << accept_socket_.has_value() << std::endl;
-        acceptor_.emplace(tcp::acceptor(io_context, endpoint_));
+        // A stale socket file from a previous server would make the bind fail
+        const auto *unix_address = reinterpret_cast<const sockaddr_un *>(endpoint_.data());
+        if (endpoint_.protocol().family() == AF_UNIX && unix_address->sun_path[0] != '\0') {
+            unlink(unix_address->sun_path);
+        }
+        acceptor_.emplace(io_context, endpoint_);
         if (!acceptor_.has_value()) {
             std::cerr << "Acceptor is not initialized!" << std::endl;
         }
@@ -53,16 +86,41 @@ TCPConnection::TCPConnection(asio::io_context& io_context, const std::string& ip
     }
 }
 
+TCPConnection::stream_protocol::endpoint TCPConnection::MakeEndpoint(const std::string& address, const uint16_t port) {
+    const std::string unix_prefix = "unix:";
+    const std::string shm_prefix = "shm:";
+    const std::string udp_prefix = "udp:";
+    const std::string sim_prefix = "sim:";
+    if (address.compare(0, shm_prefix.size(), shm_prefix) == 0 || address.compare(0, udp_prefix.size(), udp_prefix) == 0 ||
+        address.compare(0, sim_prefix.size(), sim_prefix) == 0) {
+        return stream_protocol::endpoint(); // no stream socket
+    }
+    if (address.compare(0, unix_prefix.size(), unix_prefix) != 0) {
+        return tcp::endpoint(asio::ip::make_address(address), port);
+    }
+    std::string path = address.substr(unix_prefix.size()) + "." + std::to_string(port);
+    if (path.front() == '@') path.front() = '\0'; // abstract namespace
+    return asio::local::stream_protocol::endpoint(path);
+}
+
 TCPConnection::~TCPConnection() {
     // Stop the server from accepting new connections
-    send_command_buffer_.clear();
+    AbortSendBuffer();
+    AbortWaiters();
     recv_command_buffer_.clear();
 
-    send_cmd_available_.notify_one();
     stop_server_.store(true);
     stop_cmd_write_.store(true);
+    send_cmd_available_.notify_one();
 
-    if (write_data_thread_.joinable()) write_data_thread_.join();
+    // The shared memory receive thread starts the send thread, so join it first
+    if (read_data_thread_.joinable()) read_data_thread_.join();
+    if (write_data_thread_.joinable()) {
+        // The send thread holds a reference, so the last one may be released on the send thread itself
+        if (write_data_thread_.get_id() == std::this_thread::get_id()) write_data_thread_.detach();
+        else write_data_thread_.join();
+    }
+    if (recv_notify_fd_ >= 0) close(recv_notify_fd_);
     if (debug_flag_) std::cout << "Clearing TCP buffers and closing connections ..." << std::endl;
 
     if (socket_.is_open()) {
@@ -70,12 +128,29 @@ TCPConnection::~TCPConnection() {
         socket_.close();
         if (debug_flag_) std::cout << "Closed TCP socket" << std::endl;
     }
+    if (udp_socket_ && udp_socket_->is_open()) {
+        asio::error_code ignored_ec;
+        udp_socket_->close(ignored_ec);
+    }
 
     std::cout << "Destructed TCP connection [" << port_ << "]" << std::endl;
 }
 
 void TCPConnection::Start() {
-    if (is_server_) {
+    if (!shm_name_.empty()) {
+        std::cout << "Starting shared memory link [" << shm_name_ << "]" << std::endl;
+        read_data_thread_ = std::thread(&TCPConnection::ShmReadData, this);
+    }
+    else if (sim_) {
+        std::cout << "Starting simulated link.." << std::endl;
+        sim_->AddParticipant();
+        read_data_thread_ = std::thread(&TCPConnection::SimReadData, this);
+    }
+    else if (udp_socket_) {
+        std::cout << "Starting UDP monitor link.." << std::endl;
+        StartDatagram();
+    }
+    else if (is_server_) {
         std::cout << "Starting Server.." << std::endl;
         StartServer();
     }
@@ -92,27 +167,43 @@ void TCPConnection::StartServer() {
         return;
     }
     auto self = shared_from_this();
+    // The last accepted socket was moved out, executor and all, so accept into a fresh one
+    accept_socket_.emplace(acceptor_->get_executor());
     acceptor_->async_accept(*accept_socket_, [this, self](std::error_code ec) {
       if (!ec) {
         std::cout << "New client connected!" << std::endl;
-          socket_ = std::move(*accept_socket_);
-          tcp_protocol_.RestartDecoder();
-          requested_bytes_ = sizeof(TCPProtocol::Header);
-          requested_bytes_ = sizeof(TCPProtocol::Header);
-          // auto self = shared_from_this();
-          std::thread(&TCPConnection::ReadData, self).detach();
-          std::thread(&TCPConnection::SendData, self).detach();
-          if (use_heartbeat_) std::thread(&TCPConnection::SendHeartbeat, self).detach();
-      } else {
-          if (debug_flag_) std::cout << "Client connection failed with error: " << ec.message() << std::endl;
+          // Stop the send thread of the previous client before its socket is replaced, only one
+          // thread may use the send state (batching, compression) at a time
+          StopSendThread([this, self]() {
+              socket_ = std::move(*accept_socket_);
+              tcp_protocol_.RestartDecoder();
+              requested_bytes_ = sizeof(TCPProtocol::Header);
+              SendCapabilities();
+              std::thread(&TCPConnection::ReadData, self).detach();
+              StartSendThread();
+              if (use_heartbeat_) std::thread(&TCPConnection::SendHeartbeat, self).detach();
+              if (!stop_server_.load()) StartServer();  // Accept the next client
+          });
+          return;
       }
+      if (debug_flag_) std::cout << "Client connection failed with error: " << ec.message() << std::endl;
       if (!stop_server_.load()) StartServer();  // Accept the next client
     });
 }
 
 void TCPConnection::StartClient() {
     if (stop_server_.load()) return;
-    std::this_thread::sleep_for(std::chrono::seconds(1)); // sleep for 1s to keep from reconnecting to a zombie port
+    if (Failover()) return; // the standby took over
+    // Wait to keep from reconnecting to a zombie port, on a timer so the io thread carries on meanwhile
+    auto self = shared_from_this();
+    reconnect_timer_.expires_after(kReconnectDelay);
+    reconnect_timer_.async_wait([this, self](const asio::error_code &ec) {
+        if (ec || stop_server_.load()) return;
+        Reconnect();
+    });
+}
+
+void TCPConnection::Reconnect() {
     if (socket_.is_open()) {
         if (debug_flag_) std::cout << "Empty and Cancel socket operations" << std::endl;
         std::unique_lock<std::mutex> slock(sock_mutex_);
@@ -124,24 +215,23 @@ void TCPConnection::StartClient() {
         slock.unlock();
         if (debug_flag_) std::cout << "Socket cancelled and closed" << std::endl;
     }
-    if (write_data_thread_.joinable()) {
-        stop_cmd_write_.store(true);
-        send_cmd_available_.notify_one();
-        if (debug_flag_) std::cout << "Joining write thread before restarting" << std::endl;
-        write_data_thread_.join();
-        stop_cmd_write_.store(false);
-    }
+    auto self = shared_from_this();
+    StopSendThread([this, self]() { Connect(); });
+}
+
+void TCPConnection::Connect() {
     timer_.cancel();
     client_connected_ = false;
     tcp_protocol_.RestartDecoder();
     requested_bytes_ = sizeof(TCPProtocol::Header);
-    send_command_buffer_.clear();
+    AbortSendBuffer();
     received_bytes_ = 0;
+    prefilled_bytes_ = 0;
 
     if (debug_flag_) std::cout << "--> Async_connect" << std::endl;
     // Receive command socket
     auto self = shared_from_this();
-    socket_.async_connect(endpoint_, [this, self](const asio::error_code& ec) {
+    socket_.async_connect(endpoints_[active_endpoint_], [this, self](const asio::error_code& ec) {
         if (!ec) {
             std::cout << "Receive socket connected to server! [" << port_ << "]" << " 0FD: " << socket_.native_handle() << std::endl;
             timeout_.cancel();
@@ -152,24 +242,24 @@ void TCPConnection::StartClient() {
             // so they don't use a CPU unless data is being processed
             tcp_protocol_.RestartDecoder();
             restart_client_ = false;
-            requested_bytes_ = monitor_link_ ? 0xFFFF : sizeof(TCPProtocol::Header); // large read for status link
+            requested_bytes_ = FirstReadSize(); // large read for status link
             ReadData(); // move this to an ASIO event driven operation instead of a thread
-            auto self = shared_from_this();
-            write_data_thread_ = std::thread(&TCPConnection::SendData, self);
+            StartSendThread();
             client_connected_ = true;
+            SendCapabilities();
+            std::lock_guard<std::mutex> lock(standby_mutex_);
+            standby_endpoint_ = active_endpoint_;
+            ConnectStandby(std::chrono::milliseconds(0));
         } else {
             std::cerr << "Receive socket connection failed: " << ec.message() << " [" << port_ << "]" << std::endl;
-            if (write_data_thread_.joinable()) {
-                stop_cmd_write_.store(true);
-                send_cmd_available_.notify_one();
-                if (debug_flag_) std::cout << "Joining write thread before restarting" << std::endl;
-                write_data_thread_.join();
-                stop_cmd_write_.store(false);
-            }
-            if (stop_server_.load()) return;
-            std::this_thread::sleep_for(std::chrono::seconds(2));
+            active_endpoint_ = (active_endpoint_ + 1) % endpoints_.size(); // try the next endpoint, if any
             if (stop_server_.load()) return;
-            StartClient();
+            // The send thread only starts once connected, so there is none to stop before retrying
+            reconnect_timer_.expires_after(std::chrono::seconds(2));
+            reconnect_timer_.async_wait([this, self](const asio::error_code &ec) {
+                if (ec || stop_server_.load()) return;
+                StartClient();
+            });
         }
     });
 
@@ -179,34 +269,424 @@ void TCPConnection::StartClient() {
         if (ec == asio::error::operation_aborted) {
             return; // Timer cancelled, connection completed successfully
         }
-        // Timeout expired
+        // Timeout expired, the connect's handler retries once the socket gives up
         if (debug_flag_) std::cout << "Connection timed out. [" << port_ << "]" << std::endl;
-        // Wait for 2s before trying again
-        std::this_thread::sleep_for(std::chrono::seconds(2));
-        // StartClient();
     });
 }
 
+void TCPConnection::AddFailoverEndpoint(const std::string& address, const uint16_t port) {
+    if (is_server_ || !shm_name_.empty() || sim_ || udp_socket_) {
+        throw std::invalid_argument("Failover endpoints are only supported on stream clients");
+    }
+    const auto endpoint = MakeEndpoint(address, port);
+    if (endpoint.protocol().family() != endpoint_.protocol().family()) {
+        throw std::invalid_argument("Failover endpoints must use the same transport as the link");
+    }
+    endpoints_.push_back(endpoint);
+}
+
+// Called holding standby_mutex_. Connect the standby to the endpoint after the last one tried, skipping
+// the active one, after the delay. Any standby already connected is replaced
+void TCPConnection::ConnectStandby(const std::chrono::milliseconds delay) {
+    if (endpoints_.size() < 2 || stop_server_.load()) return;
+    DropStandby();
+    auto self = shared_from_this();
+    standby_timer_.expires_after(delay);
+    standby_timer_.async_wait([this, self](const asio::error_code &ec) {
+        if (ec || stop_server_.load()) return;
+        std::lock_guard<std::mutex> lock(standby_mutex_);
+        standby_endpoint_ = (standby_endpoint_ + 1) % endpoints_.size();
+        if (standby_endpoint_ == active_endpoint_) standby_endpoint_ = (standby_endpoint_ + 1) % endpoints_.size();
+        standby_socket_.emplace(socket_.get_executor());
+        const uint64_t generation = standby_generation_;
+        standby_socket_->async_connect(endpoints_[standby_endpoint_], [this, self, generation](const asio::error_code &ec) {
+            std::lock_guard<std::mutex> lock(standby_mutex_);
+            if (generation != standby_generation_ || stop_server_.load()) return;
+            if (ec) {
+                if (debug_flag_) std::cerr << "Standby connection failed: " << ec.message() << " [" << port_ << "]" << std::endl;
+                ConnectStandby(std::chrono::seconds(1));
+                return;
+            }
+            asio::error_code ignored_ec;
+            standby_socket_->set_option(asio::socket_base::send_buffer_size(1 * 1024), ignored_ec);
+            standby_socket_->non_blocking(true, ignored_ec); // drained with non-blocking reads
+            standby_ready_ = true;
+            std::cout << "Standby connected to endpoint [" << standby_endpoint_ << "] [" << port_ << "]" << std::endl;
+            WaitStandby();
+        });
+    });
+}
+
+// Called holding standby_mutex_. Wait for the standby to become readable, a wait consumes no data
+// so a failover never loses bytes to a cancelled read
+void TCPConnection::WaitStandby() {
+    auto self = shared_from_this();
+    const uint64_t generation = standby_generation_;
+    standby_socket_->async_wait(asio::socket_base::wait_read, [this, self, generation](const asio::error_code &ec) {
+        std::lock_guard<std::mutex> lock(standby_mutex_);
+        if (ec || generation != standby_generation_) return; // taken over or replaced
+        ReadStandby();
+    });
+}
+
+// Called holding standby_mutex_. Drain the standby and answer the heartbeats in it, the other frames are
+// kept for the decoder up to kMaxStandbyBytes, then only capabilities. Heartbeats are acked like the link
+// does so the peer keeps the standby connected
+void TCPConnection::ReadStandby() {
+    auto word16 = [this](const size_t pos) {
+        return static_cast<uint16_t>(standby_bytes_[pos] << 8 | standby_bytes_[pos + 1]);
+    };
+    std::array<uint8_t, 4096> chunk{};
+    asio::error_code ec;
+    while (!ec) {
+        const size_t bytes = standby_socket_->read_some(asio::buffer(chunk), ec);
+        standby_bytes_.insert(standby_bytes_.end(), chunk.begin(), chunk.begin() + bytes);
+        // Scanned chunk by chunk so a busy peer can't grow the buffer past the limit by much
+        size_t pos = standby_scanned_;
+        while (standby_bytes_.size() - pos >= TCPProtocol::header_size_) {
+            if (!TCPProtocol::GoodStartCode(word16(pos), word16(pos + 2))) {
+                std::cerr << "Bad frame on the standby connection [" << port_ << "]" << std::endl;
+                ConnectStandby(std::chrono::seconds(1));
+                return;
+            }
+            const uint16_t cmd = word16(pos + 4);
+            const size_t frame_bytes = TCPProtocol::header_size_ + word16(pos + 6) * sizeof(uint32_t) + TCPProtocol::footer_size_;
+            if (standby_bytes_.size() - pos < frame_bytes) break;
+            if (cmd != TCPProtocol::kHeartBeat) {
+                if (cmd == TCPProtocol::kCapabilities || pos + frame_bytes <= kMaxStandbyBytes) {
+                    pos += frame_bytes;
+                } else {
+                    if (debug_flag_) std::cout << "Standby buffer full, dropped cmd: " << cmd << " [" << port_ << "]" << std::endl;
+                    standby_bytes_.erase(standby_bytes_.begin() + pos, standby_bytes_.begin() + pos + frame_bytes);
+                }
+                continue;
+            }
+            standby_bytes_.erase(standby_bytes_.begin() + pos, standby_bytes_.begin() + pos + frame_bytes);
+            if (!monitor_link_) {
+                TCPProtocol ack(TCPProtocol::kHeartBeat, 1);
+                ack.arguments[0] = static_cast<uint32_t>(frame_bytes);
+                // The socket is non-blocking, an ack which doesn't go out whole would leave the stream torn
+                asio::error_code write_ec;
+                const size_t written = asio::write(*standby_socket_, asio::buffer(ack.Serialize()), write_ec);
+                if (write_ec) {
+                    std::cerr << "Failed to ack a heartbeat on the standby connection: " << write_ec.message()
+                              << " [" << port_ << "]" << std::endl;
+                    if (written == 0 && (write_ec == asio::error::would_block || write_ec == asio::error::try_again)) {
+                        continue; // nothing went out, the peer sees a missed ack and the standby stays usable
+                    }
+                    ConnectStandby(std::chrono::seconds(1));
+                    return;
+                }
+            }
+        }
+        standby_scanned_ = pos;
+    }
+    if (ec != asio::error::would_block && ec != asio::error::try_again) {
+        std::cerr << "Standby connection lost: " << ec.message() << " [" << port_ << "]" << std::endl;
+        ConnectStandby(std::chrono::seconds(1));
+        return;
+    }
+    WaitStandby();
+}
+
+// Called holding standby_mutex_
+void TCPConnection::DropStandby() {
+    standby_generation_++;
+    standby_ready_ = false;
+    standby_socket_.reset();
+    standby_bytes_.clear();
+    standby_scanned_ = 0;
+}
+
+// Called on an io thread when the link fails. Swap the standby in for the failed socket, restart the
+// send thread on it with the queue as it was and decode what the standby buffered before reading on.
+// The swap happens once the old send thread has stopped
+bool TCPConnection::Failover() {
+    std::unique_lock<std::mutex> lock(standby_mutex_);
+    if (!standby_ready_) return false;
+    const auto start = std::chrono::steady_clock::now();
+    asio::error_code ignored_ec;
+    standby_socket_->cancel(ignored_ec);
+    auto standby = std::make_shared<stream_protocol::socket>(std::move(*standby_socket_));
+    auto buffered = std::make_shared<std::vector<uint8_t>>(std::move(standby_bytes_));
+    const size_t endpoint = standby_endpoint_;
+    DropStandby();
+    lock.unlock();
+
+    timer_.cancel();
+    client_connected_ = false;
+    {
+        std::lock_guard<std::mutex> slock(sock_mutex_);
+        socket_.cancel(ignored_ec);
+        socket_.close(ignored_ec);
+    }
+    auto self = shared_from_this();
+    StopSendThread([this, self, standby, buffered, endpoint, start]() {
+        asio::error_code ignored_ec;
+        socket_ = std::move(*standby);
+        socket_.non_blocking(false, ignored_ec);
+        active_endpoint_ = endpoint;
+        tcp_protocol_.RestartDecoder();
+        requested_bytes_ = FirstReadSize();
+        received_bytes_ = 0;
+        prefilled_bytes_ = 0;
+        restart_client_ = false;
+        SendCapabilities(); // before the buffered frames are decoded, it clears the peer's capabilities
+        // Connected before decoding, the acks and replies to what the standby buffered are queued like any others
+        client_connected_ = true;
+        if (requested_bytes_ == sizeof(TCPProtocol::Header)) FeedReceived(buffered->data(), buffered->size());
+        ReadData();
+        StartSendThread();
+        failovers_++;
+        std::cout << "Failed over to endpoint [" << endpoint << "] in "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count()
+                  << " us [" << port_ << "]" << std::endl;
+
+        std::lock_guard<std::mutex> lock(standby_mutex_);
+        standby_endpoint_ = endpoint;
+        ConnectStandby(std::chrono::milliseconds(0));
+    });
+    return true;
+}
+
+// Called on an io thread. Have the send thread stop and run next once it has exited, it is polled on a
+// timer rather than joined as it may be waiting on a write which completes on this thread
+void TCPConnection::StopSendThread(std::function<void()> next) {
+    if (write_data_thread_.joinable()) {
+        stop_cmd_write_.store(true);
+        send_cmd_available_.notify_one();
+        write_done_.notify_all();
+        if (!send_thread_exited_.load()) {
+            auto self = shared_from_this();
+            send_stop_timer_.expires_after(std::chrono::microseconds(100));
+            send_stop_timer_.async_wait([this, self, next = std::move(next)](const asio::error_code &ec) mutable {
+                if (!ec) StopSendThread(std::move(next));
+            });
+            return;
+        }
+        if (debug_flag_) std::cout << "Joining write thread before restarting" << std::endl;
+        write_data_thread_.join();
+        stop_cmd_write_.store(false);
+    }
+    next();
+}
+
+void TCPConnection::StartSendThread() {
+    send_thread_exited_.store(false);
+    write_data_thread_ = std::thread(&TCPConnection::SendData, shared_from_this());
+}
+
+// Run bytes received outside of ReadData through the decoder, a partial stage is left in buffer_
+// for the next read to complete
+void TCPConnection::FeedReceived(const uint8_t *data, const size_t size) {
+    size_t pos = 0;
+    while (requested_bytes_ > 0 && size - pos >= requested_bytes_) {
+        std::memcpy(buffer_.data(), data + pos, requested_bytes_);
+        pos += requested_bytes_;
+        DecodeReceived(requested_bytes_);
+    }
+    prefilled_bytes_ = size - pos;
+    std::memcpy(buffer_.data(), data + pos, prefilled_bytes_);
+}
+
+void TCPConnection::ShmReadData() {
+    ThreadControl::Scope scope("recv", port_);
+    // The server creates the segment, the client keeps retrying until the server has created it
+    while (!shm_ && !stop_server_.load()) {
+        try {
+            shm_ = std::make_unique<ShmTransport>(shm_name_, is_server_);
+        } catch (const std::runtime_error &e) {
+            if (is_server_) {
+                std::cerr << e.what() << std::endl;
+                return;
+            }
+            if (debug_flag_) std::cerr << e.what() << std::endl;
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+    }
+    if (!shm_) return;
+    std::cout << "Shared memory link connected [" << shm_name_ << "]" << std::endl;
+    client_connected_ = true;
+    shm_connected_.store(true);
+    SendCapabilities();
+    StartSendThread();
+    // Read exactly what the decoder asks for, the ring already holds whole frames
+    while (shm_->Read(buffer_.data(), requested_bytes_, stop_server_)) {
+        DecodeReceived(requested_bytes_);
+    }
+    shm_connected_.store(false);
+}
+
+void TCPConnection::SimReadData() {
+    ThreadControl::Scope scope("recv", port_);
+    const auto direction = is_server_ ? SimLink::kToServer : SimLink::kToClient;
+    while (const uint64_t session = sim_->WaitUp(stop_server_)) {
+        std::cout << "Simulated link connected, session " << session << " [" << port_ << "]" << std::endl;
+        tcp_protocol_.RestartDecoder();
+        requested_bytes_ = sizeof(TCPProtocol::Header);
+        received_bytes_ = 0;
+        sim_session_.store(session);
+        client_connected_ = true;
+        sim_connected_.store(true);
+        SendCapabilities();
+        // The link's threads are added before they start so the clock can't move on without them
+        sim_->AddParticipant();
+        write_data_thread_ = std::thread([this] { SendData(); sim_->RemoveParticipant(); });
+        std::thread heartbeat_thread;
+        if (is_server_ && use_heartbeat_) {
+            sim_->AddParticipant();
+            heartbeat_thread = std::thread([this] { SendHeartbeat(); sim_->RemoveParticipant(); });
+        }
+        SimLink::ReadResult result;
+        while ((result = sim_->Read(direction, buffer_.data(), requested_bytes_, session, stop_server_,
+                                    ReadTimeoutArmed() ? kReadTimeout : SimLink::Duration::max())) == SimLink::kRead) {
+            DecodeReceived(requested_bytes_);
+        }
+        if (result == SimLink::kTimedOut) {
+            std::cout << "Read timeout or no heartbeat received, closing the simulated link [" << port_ << "]" << std::endl;
+            packet_read_ = false;
+            sim_->Close(session, kReconnectDelay);
+        }
+        // Dropped, restart the send thread on the next session as a reconnect would
+        sim_connected_.store(false);
+        client_connected_ = false;
+        stop_cmd_write_.store(true);
+        send_cmd_available_.notify_one();
+        write_done_.notify_all();
+        write_data_thread_.join();
+        if (heartbeat_thread.joinable()) heartbeat_thread.join();
+        if (stop_server_.load()) break;
+        stop_cmd_write_.store(false);
+        AbortSendBuffer();
+        std::cout << "Simulated link dropped [" << port_ << "]" << std::endl;
+    }
+    sim_->RemoveParticipant();
+}
+
+void TCPConnection::StartDatagram() {
+    // Throws like the acceptor if the address can't be used
+    udp_socket_->open(udp_endpoint_.protocol());
+    if (is_server_) udp_socket_->bind(udp_endpoint_);
+    else udp_socket_->connect(udp_endpoint_);
+    client_connected_ = true;
+    ReadDatagram();
+    StartSendThread();
+}
+
+void TCPConnection::ReadDatagram() {
+    if (stop_server_.load()) return;
+    auto self = shared_from_this();
+    // Scatter the sequence number and the frame so the frame starts at the front of its buffer
+    std::array<asio::mutable_buffer, 2> buffers{asio::buffer(&recv_datagram_seq_, sizeof(recv_datagram_seq_)),
+                                                asio::buffer(datagram_buffer_)};
+    udp_socket_->async_receive_from(buffers, udp_sender_, [this, self](const asio::error_code& ec, std::size_t bytes_transferred) {
+        if (ec == asio::error::operation_aborted) return;
+        if (!ec) {
+            HandleDatagram(bytes_transferred);
+        } else if (debug_flag_) {
+            // eg. connection_refused from an ICMP unreachable while the server is down, just keep listening
+            std::cerr << "Datagram receive error: " << ec.message() << " [" << port_ << "]" << std::endl;
+        }
+        ReadDatagram();
+    });
+}
+
+void TCPConnection::HandleDatagram(const std::size_t bytes_transferred) {
+    if (bytes_transferred < sizeof(recv_datagram_seq_)) {
+        datagrams_corrupt_++;
+        return;
+    }
+    const size_t frame_bytes = bytes_transferred - sizeof(recv_datagram_seq_);
+
+    // Run the frame through the stream decoder one stage at a time, it reads each stage from the front of buffer_
+    Command cmd(0, 0);
+    size_t offset = 0;
+    size_t stage_bytes = sizeof(TCPProtocol::Header);
+    tcp_protocol_.RestartDecoder();
+    while (stage_bytes != SIZE_MAX && stage_bytes != TCPProtocol::kCorruptData && offset + stage_bytes <= frame_bytes) {
+        std::memcpy(buffer_.data(), datagram_buffer_.data() + offset, stage_bytes);
+        offset += stage_bytes;
+        stage_bytes = tcp_protocol_.DecodePackets(buffer_, cmd);
+    }
+    tcp_protocol_.RestartDecoder();
+    if (stage_bytes != SIZE_MAX) {
+        datagrams_corrupt_++;
+        return;
+    }
+
+    // Only the newest snapshot matters, count the gap and move on instead of waiting for a resend.
+    // A large step back means the sender restarted its sequence, so resync on it
+    constexpr int32_t kReorderWindow = 1024;
+    const uint32_t seq = ntohl(recv_datagram_seq_);
+    const auto step = static_cast<int32_t>(seq - expected_datagram_seq_);
+    if (datagram_seq_synced_ && step < 0 && step > -kReorderWindow) {
+        datagrams_out_of_order_++;
+        return;
+    }
+    if (datagram_seq_synced_ && step > 0) datagrams_lost_ += step;
+    datagram_seq_synced_ = true;
+    expected_datagram_seq_ = seq + 1;
+    datagrams_received_++;
+    last_datagram_ns_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    if (is_server_) {
+        std::lock_guard<std::mutex> lock(udp_mutex_);
+        udp_peer_ = udp_sender_;
+        udp_peer_known_ = true;
+    }
+    ProcessCommand(cmd);
+}
+
+asio::error_code TCPConnection::SendDatagram(const std::vector<uint8_t> &frame) {
+    asio::error_code ec;
+    const uint32_t seq = htonl(send_datagram_seq_++);
+    std::array<asio::const_buffer, 2> buffers{asio::buffer(&seq, sizeof(seq)), asio::buffer(frame)};
+    if (is_server_) {
+        std::lock_guard<std::mutex> lock(udp_mutex_);
+        if (!udp_peer_known_) return asio::error::not_connected; // no client has been heard from yet
+        udp_socket_->send_to(buffers, udp_peer_, 0, ec);
+    } else {
+        udp_socket_->send(buffers, 0, ec);
+    }
+    return ec;
+}
+
+TCPConnection::DatagramStats TCPConnection::GetDatagramStats() const {
+    DatagramStats stats{datagrams_received_.load(), datagrams_lost_.load(), datagrams_out_of_order_.load(),
+                        datagrams_corrupt_.load(), std::chrono::milliseconds::max()};
+    const int64_t last_ns = last_datagram_ns_.load();
+    if (last_ns != 0) {
+        stats.age = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch() - std::chrono::nanoseconds(last_ns));
+    }
+    return stats;
+}
+
 void TCPConnection::ClearSocketBuffer() {
     asio::error_code ignored_ec;
-    // FIXME add return if !socket.is_open()
     if (!socket_.is_open()) return;
     std::unique_lock<std::mutex> slock(sock_mutex_);
-    const size_t bytes_available = socket_.available(ignored_ec);
-    if (bytes_available > 0) {
-        std::vector<uint8_t> temp_buffer(bytes_available);
-        socket_.read_some(asio::buffer(temp_buffer), ignored_ec);
-        temp_buffer.clear();
+    // Drain with non-blocking reads until the socket would block instead of sizing a blocking read
+    // with available(). With the io_uring backend a cancelled receive can still be in flight and
+    // consume the data, so the available() count may be stale and a blocking read_some could hang.
+    // Stop after one receive buffer worth so a peer which keeps sending can't hold us here
+    const bool was_non_blocking = socket_.non_blocking();
+    socket_.non_blocking(true, ignored_ec);
+    std::vector<uint8_t> temp_buffer(64 * 1024);
+    size_t bytes_cleared = 0;
+    asio::error_code read_ec;
+    while (!read_ec && bytes_cleared < TCPProtocol::RECVBUFFSIZE) {
+        bytes_cleared += socket_.read_some(asio::buffer(temp_buffer), read_ec);
     }
+    socket_.non_blocking(was_non_blocking, ignored_ec);
     slock.unlock();
-    if (debug_flag_) std::cout << "Emptied buffer of " << bytes_available << "B" << std::endl;
+    if (debug_flag_) std::cout << "Emptied buffer of " << bytes_cleared << "B" << std::endl;
 }
 
 void TCPConnection::ReadData() {
     // Set timeout to 1 seconds, the heartbeat
     if (stop_server_.load()) return;
     if (!is_server_ && restart_client_.load()) StartClient();
-    constexpr auto read_timeout = std::chrono::milliseconds(5000); // give 0.5s grace period
 
     if (debug_flag_) std::cout << "Setting read to " << requested_bytes_ << "B " << std::endl;
 
@@ -214,15 +694,16 @@ void TCPConnection::ReadData() {
     auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - start_).count();
     auto self = shared_from_this();
     asio::async_read( socket_,// Or async_read if you need exactly N bytes
-                      asio::buffer(buffer_, requested_bytes_), // Read up to buffer size
+                      // Read up to buffer size, after any bytes a failover already put in the buffer
+                      asio::buffer(buffer_.data() + prefilled_bytes_, requested_bytes_ - prefilled_bytes_),
                 std::bind(&TCPConnection::ReadHandler, self, std::placeholders::_1, std::placeholders::_2)
     );
 
     // Timeout in case something happens in the middle of the packet read
     // if (!is_server_ && client_connected_ && (packet_read_ || use_heartbeat_) && !monitor_link_) {
-    if ((is_server_ || client_connected_) && (packet_read_ || use_heartbeat_)) {
+    if (ReadTimeoutArmed()) {
         if (debug_flag_) std::cout << "Resetting read timer [" << reset_read_timer_ << "]" << " (" << elapsed << ")" << std::endl;
-        timer_.expires_after(read_timeout);
+        timer_.expires_after(kReadTimeout);
         start_ = now;
         auto self = shared_from_this();
         timer_.async_wait([this, self](const asio::error_code& ec) {
@@ -254,54 +735,10 @@ void TCPConnection::ReadHandler(const asio::error_code& ec, std::size_t bytes_tr
 
     reset_read_timer_ = false;
     if (!ec) {
+        bytes_transferred += std::exchange(prefilled_bytes_, 0);
         // If the requested data was read from the socket we can decode it
         if (bytes_transferred == requested_bytes_) {
-            packet_read_ = true;
-            received_bytes_ += bytes_transferred;
-            // The DecodePackets uses an internal state machine to iterate through the packet eg, Header, Payload, Footer
-            // Returns 0 when the end of the packet frame is reached
-            { // scope the mutex to just apply to the decode call since it fills the receiver buffer
-                std::lock_guard<std::mutex> lock(recv_mutex_);
-                requested_bytes_ = tcp_protocol_.DecodePackets(buffer_, recv_command_);
-            }
-            // Will keep getting kCorruptData until a good start code is found
-            if (requested_bytes_ == TCPProtocol::kCorruptData) { // 0xFFFFFFFF
-                if (debug_flag_) std::cout << "Corrupted data received! :'(" << std::endl;
-                timer_.cancel(); // cancel the wait since we are receiving data just corrupted
-                requested_bytes_ = sizeof(TCPProtocol::Header);
-                tcp_protocol_.RestartDecoder(); // make sure to set the state machine to expect a header
-                received_bytes_ = 0;
-                std::vector<uint32_t> tmp;
-                WriteSendBuffer(TCPProtocol::kCorruptData, tmp);
-            } else if (requested_bytes_ == SIZE_MAX) { // end of good packet
-                if (debug_flag_) std::cout << "Cancelling timer, expiry: " << std::endl;
-                timer_.cancel(); // anything we receive should count as a heartbeat
-                if (use_heartbeat_ && recv_command_.command == TCPProtocol::kHeartBeat) {
-                    // 1/21 If a heartbeat can just use the cmd itself without writing to buffer
-                    // Track the hearbeat count so we don't over-print but can still monitor
-                    heartbeat_count_++;
-                    if ((heartbeat_count_ % 60) == 0) {
-                        std::cout << "Heartbeat count: " << heartbeat_count_ << std::endl;
-                    }
-                    reset_read_timer_ = true;
-                } else {
-                    // Full packet received so place into the queue and notify consumers, except for heartbeat
-                    WriteRecvBuffer(recv_command_);
-                    cmd_available_.notify_all();
-                }
-
-                packet_read_ = false;
-                requested_bytes_ = sizeof(TCPProtocol::Header);
-                chrono_read_start_= std::chrono::high_resolution_clock::now();
-
-                // Send an ack back after receiving a message, for client, command link only
-                // per specification the ack should be the command + num received bytes
-                if (!is_server_ && !monitor_link_) { // remove condition DataInRecvBuffer() 1/28
-                    std::vector<uint32_t> data = { static_cast<uint32_t>(received_bytes_) };
-                    WriteSendBuffer(recv_command_.command, data);
-                }
-                received_bytes_ = 0;
-            }
+            DecodeReceived(bytes_transferred);
             // 2. Initiate the *next* read operation
             ReadData(); // Loop back to wait for more data
             // TODO check if the returned bytes is 0 for Status link, indicating a broken link
@@ -314,6 +751,7 @@ void TCPConnection::ReadHandler(const asio::error_code& ec, std::size_t bytes_tr
                 {
                     std::lock_guard<std::mutex> lock(recv_mutex_);
                     recv_command_buffer_.pop_back();
+                    ClearRecvNotify();
                 }
             }
             received_bytes_ = 0;
@@ -325,9 +763,12 @@ void TCPConnection::ReadHandler(const asio::error_code& ec, std::size_t bytes_tr
             }
             ClearSocketBuffer();
             tcp_protocol_.RestartDecoder();
-            requested_bytes_ = monitor_link_ ? 0xFFFF : sizeof(TCPProtocol::Header);
+            requested_bytes_ = FirstReadSize();
             ReadData(); // Loop back to wait for more data
         }
+    } else if (ec == asio::error::operation_aborted) {
+        // The socket was cancelled by whatever is restarting or stopping the link, it carries on from there
+        if (debug_flag_) std::cout << "Read cancelled [" << port_ << "]" << std::endl;
     } else if (ec == asio::error::eof) {
         if (debug_flag_) std::cout << "Connection closed by peer (EOF).\n";
         if (client_connected_ && !stop_server_.load() && !stop_cmd_write_.load()) {
@@ -347,9 +788,53 @@ void TCPConnection::ReadHandler(const asio::error_code& ec, std::size_t bytes_tr
     }
 }
 
+// Feed the requested bytes in buffer_ to the decoder and handle the frame once it is complete
+void TCPConnection::DecodeReceived(const std::size_t bytes_transferred) {
+    packet_read_ = true;
+    received_bytes_ += bytes_transferred;
+    // The DecodePackets uses an internal state machine to iterate through the packet eg, Header, Payload, Footer
+    // Returns 0 when the end of the packet frame is reached
+    { // scope the mutex to just apply to the decode call since it fills the receiver buffer
+        std::lock_guard<std::mutex> lock(recv_mutex_);
+        requested_bytes_ = tcp_protocol_.DecodePackets(buffer_, recv_command_);
+    }
+    // Will keep getting kCorruptData until a good start code is found
+    if (requested_bytes_ == TCPProtocol::kCorruptData) { // 0xFFFFFFFF
+        if (debug_flag_) std::cout << "Corrupted data received! :'(" << std::endl;
+        timer_.cancel(); // cancel the wait since we are receiving data just corrupted
+        requested_bytes_ = sizeof(TCPProtocol::Header);
+        tcp_protocol_.RestartDecoder(); // make sure to set the state machine to expect a header
+        received_bytes_ = 0;
+        std::vector<uint32_t> tmp;
+        WriteSendBuffer(TCPProtocol::kCorruptData, tmp);
+    } else if (requested_bytes_ == SIZE_MAX) { // end of good packet
+        if (debug_flag_) std::cout << "Cancelling timer, expiry: " << std::endl;
+        timer_.cancel(); // anything we receive should count as a heartbeat
+        if (use_heartbeat_ && recv_command_.command == TCPProtocol::kHeartBeat) {
+            // 1/21 If a heartbeat can just use the cmd itself without writing to buffer
+            // Track the hearbeat count so we don't over-print but can still monitor
+            heartbeat_count_++;
+            if ((heartbeat_count_ % 60) == 0) {
+                std::cout << "Heartbeat count: " << heartbeat_count_ << std::endl;
+            }
+            reset_read_timer_ = true;
+            SendAck(recv_command_.command, received_bytes_, std::nullopt);
+        } else {
+            // Full packet received so dispatch it or place into the queue and notify consumers
+            ProcessCommand(recv_command_);
+        }
+
+        packet_read_ = false;
+        requested_bytes_ = sizeof(TCPProtocol::Header);
+        chrono_read_start_= std::chrono::high_resolution_clock::now();
+        received_bytes_ = 0;
+    }
+}
+
 bool TCPConnection::DataInSendBuffer() {
     std::lock_guard<std::mutex> lock(send_mutex_);
-    return !send_command_buffer_.empty();
+    if (!send_command_buffer_.empty()) return true;
+    return std::any_of(shaped_queues_.begin(), shaped_queues_.end(), [](const auto &queue) { return !queue.empty(); });
 }
 
 bool TCPConnection::DataInRecvBuffer() {
@@ -367,6 +852,7 @@ Command TCPConnection::ReadRecvBuffer() {
     // The conditional variable acquires lock upon waking, unlocked when leaving scope
     Command command = recv_command_buffer_.front();
     recv_command_buffer_.pop_front();
+    ClearRecvNotify();
     return command;
 }
 
@@ -394,83 +880,1011 @@ std::vector<Command> TCPConnection::ReadRecvBuffer(size_t num_cmds) {
     return commands;
 }
 
+bool TCPConnection::ReadRecvBuffer(Command &cmd, const std::chrono::milliseconds timeout) {
+    std::unique_lock cmd_lock(recv_mutex_);
+    const bool cmd_ready = cmd_available_.wait_for(cmd_lock, timeout, [this] {
+        return !recv_command_buffer_.empty() || stop_cmd_read_;
+    });
+    if (!cmd_ready || stop_cmd_read_) return false;
+    cmd = std::move(recv_command_buffer_.front());
+    recv_command_buffer_.pop_front();
+    ClearRecvNotify();
+    return true;
+}
+
+std::vector<Command> TCPConnection::ReadRecvBuffer(const size_t num_cmds, const std::chrono::milliseconds timeout) {
+    std::vector<Command> commands;
+    std::unique_lock cmd_lock(recv_mutex_);
+    const bool cmd_ready = cmd_available_.wait_for(cmd_lock, timeout, [this] {
+        return !recv_command_buffer_.empty() || stop_cmd_read_;
+    });
+    if (!cmd_ready || stop_cmd_read_) return commands;
+
+    const size_t num_reads = std::min(num_cmds, recv_command_buffer_.size());
+    commands.reserve(num_reads);
+    for (size_t i = 0; i < num_reads; i++) {
+        // Move the arguments out of the queue, the caller owns them from here
+        if (recv_command_buffer_.front().command != TCPProtocol::kHeartBeat) {
+            commands.push_back(std::move(recv_command_buffer_.front()));
+        }
+        recv_command_buffer_.pop_front();
+    }
+    ClearRecvNotify();
+    return commands;
+}
+
 void TCPConnection::EchoData() {
     if (debug_flag_) std::cout << "EchoData!" << std::endl;
     while (DataInRecvBuffer()) {
         WriteSendBuffer(ReadRecvBuffer());
         std::lock_guard<std::mutex> lock(recv_mutex_);
         recv_command_buffer_.pop_front();
+        ClearRecvNotify();
     }
 }
 
 void TCPConnection::SendHeartbeat() {
+    ThreadControl::Scope scope("heartbeat", port_);
     auto heartbeat = Command(TCPProtocol::kHeartBeat, 0);
+    const uint64_t session = sim_session_.load();
     while (!stop_server_.load() && !stop_cmd_write_.load()) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        if (!sim_) {
+            std::this_thread::sleep_for(kHeartbeatPeriod);
+        } else if (!sim_->SleepFor(kHeartbeatPeriod, session, stop_server_)) {
+            break; // the session ended, the next one starts its own heartbeat
+        }
         WriteSendBuffer(heartbeat);
     }
     if (debug_flag_) std::cout << "Ending hearbeat.." << std::endl;
 }
 
 void TCPConnection::WriteSendBuffer(const uint16_t cmd, std::vector<uint32_t>& vec) {
-    Command cmd_packet(cmd, vec.size());
+    Command cmd_packet(cmd, 0);
     if (!vec.empty()) cmd_packet.arguments = std::move(vec);
-    WriteSendBuffer(cmd_packet);
+    WriteSendBuffer(std::move(cmd_packet));
 }
 
 void TCPConnection::WriteSendBuffer(const Command& cmd_struct) {
+    WriteSendBuffer(Command(cmd_struct));
+}
+
+void TCPConnection::WriteSendBuffer(Command&& cmd_struct) {
+    WriteSendBuffer(std::move(cmd_struct), nullptr);
+}
+
+void TCPConnection::WriteSendBuffer(Command&& cmd_struct, SendCallback on_sent) {
+    const uint16_t code = cmd_struct.command;
+    QueueSend({std::move(cmd_struct), std::move(on_sent), ExpiryOf(code), nullptr, code});
+}
+
+void TCPConnection::WriteSendBuffer(Command&& cmd_struct, const std::chrono::steady_clock::time_point expires,
+                                    SendCallback on_sent) {
+    const uint16_t code = cmd_struct.command;
+    QueueSend({std::move(cmd_struct), std::move(on_sent), expires, nullptr, code});
+}
+
+void TCPConnection::QueueSend(SendEntry &&entry) {
+    if (debug_flag_) std::cout << "Send cmd: " << entry.command.command << "/" << entry.command.arguments.size() << std::endl;
     if(!is_server_ && !client_connected_) {
         std::cout << "Client not connected, dropping message" << std::endl;
+        if (entry.on_sent) entry.on_sent(asio::error::not_connected);
     } else {
         std::unique_lock<std::mutex> lock(send_mutex_);
-        send_command_buffer_.emplace_back(cmd_struct);
+        SendCallback superseded = Conflate(entry);
+        WakeSimSender();
         lock.unlock();
+        if (superseded) superseded(asio::error::operation_aborted);
         send_cmd_available_.notify_one();
     }
-    if (debug_flag_) std::cout << "Send cmd: " << cmd_struct.command << "/" << cmd_struct.arguments.size() << std::endl;
+}
+
+void TCPConnection::WriteSendBuffer(std::vector<Command> &cmds) {
+    if (debug_flag_) std::cout << "Send " << cmds.size() << " cmds" << std::endl;
+    if(!is_server_ && !client_connected_) {
+        std::cout << "Client not connected, dropping " << cmds.size() << " messages" << std::endl;
+    } else {
+        std::vector<SendCallback> superseded;
+        std::unique_lock<std::mutex> lock(send_mutex_);
+        for (auto &cmd : cmds) {
+            const uint16_t code = cmd.command;
+            SendEntry entry{std::move(cmd), nullptr, ExpiryOf(code), nullptr, code};
+            if (SendCallback on_sent = Conflate(entry)) superseded.push_back(std::move(on_sent));
+        }
+        WakeSimSender();
+        lock.unlock();
+        for (auto &on_sent : superseded) on_sent(asio::error::operation_aborted);
+        send_cmd_available_.notify_one();
+    }
+    cmds.clear();
 }
 
 void TCPConnection::WriteRecvBuffer(const Command& cmd_struct) {
-    std::lock_guard<std::mutex> lock(recv_mutex_);
+    std::unique_lock<std::mutex> lock(recv_mutex_);
+    // Asynchronous receivers are first in line, the command is handed over without being queued
+    if (!recv_waiters_.empty()) {
+        ReceiveCallback waiter = std::move(recv_waiters_.front());
+        recv_waiters_.pop_front();
+        lock.unlock();
+        waiter({}, cmd_struct);
+        return;
+    }
     recv_command_buffer_.emplace_back(cmd_struct);
+    if (recv_command_buffer_.size() == 1) SignalRecvNotify();
+}
+
+void TCPConnection::ReadRecvBuffer(ReceiveCallback callback) {
+    std::unique_lock<std::mutex> lock(recv_mutex_);
+    if (stop_cmd_read_) {
+        lock.unlock();
+        callback(asio::error::operation_aborted, Command(0, 0));
+        return;
+    }
+    if (recv_command_buffer_.empty()) {
+        recv_waiters_.push_back(std::move(callback));
+        return;
+    }
+    Command command = std::move(recv_command_buffer_.front());
+    recv_command_buffer_.pop_front();
+    ClearRecvNotify();
+    lock.unlock();
+    callback({}, std::move(command));
+}
+
+void TCPConnection::Broadcast(const Command &cmd, const std::vector<std::shared_ptr<TCPConnection>> &connections) {
+    if (cmd.arguments.size() > TCPProtocol::kMaxFrameArgs) {
+        for (const auto &connection : connections) connection->WriteSendBuffer(cmd);
+        return;
+    }
+    TCPProtocol packet(cmd.command, cmd.arguments.size());
+    packet.arguments = cmd.arguments;
+    const Frame frame = std::make_shared<const std::vector<uint8_t>>(packet.Serialize());
+    for (const auto &connection : connections) {
+        connection->QueueSend({Command(cmd.command, 0), nullptr, connection->ExpiryOf(cmd.command), frame, cmd.command});
+    }
+}
+
+void TCPConnection::SendRequest(Command&& cmd_struct, ReceiveCallback on_ack, const std::chrono::milliseconds timeout) {
+    auto self = shared_from_this();
+    const bool correlated = peer_capabilities_.load() & TCPProtocol::kCapCorrelation;
+    uint32_t request_id;
+    {
+        std::lock_guard<std::mutex> lock(request_mutex_);
+        request_id = next_request_id_++;
+        PendingRequest request{cmd_struct.command, correlated, std::move(on_ack), nullptr};
+        if (timeout > kNoTimeout) {
+            request.deadline = std::make_shared<asio::steady_timer>(socket_.get_executor(), timeout);
+            request.deadline->async_wait([this, self, request_id](const asio::error_code &ec) {
+                if (ec != asio::error::operation_aborted) FailRequest(request_id, asio::error::timed_out);
+            });
+        }
+        pending_requests_.emplace(request_id, std::move(request));
+        num_pending_requests_++;
+    }
+    // Queued under its own code, the envelope's is the same for every request
+    const uint16_t code = cmd_struct.command;
+    if (correlated) cmd_struct = TCPProtocol::Correlate(request_id, std::move(cmd_struct));
+    // If the command never makes it onto the wire there will be no ack, so fail the request
+    QueueSend({std::move(cmd_struct), [this, self, request_id](const asio::error_code &ec) {
+        if (ec) FailRequest(request_id, ec);
+    }, ExpiryOf(code), nullptr, code});
+}
+
+std::future<Command> TCPConnection::SendRequest(Command&& cmd_struct, const std::chrono::milliseconds timeout) {
+    auto promise = std::make_shared<std::promise<Command>>();
+    std::future<Command> ack = promise->get_future();
+    SendRequest(std::move(cmd_struct), [promise](const asio::error_code &ec, Command ack_cmd) {
+        if (ec) {
+            promise->set_exception(std::make_exception_ptr(asio::system_error(ec)));
+        } else {
+            promise->set_value(std::move(ack_cmd));
+        }
+    }, timeout);
+    return ack;
+}
+
+bool TCPConnection::CompleteRequest(Command &cmd, const bool correlated, const uint32_t correlation_id) {
+    std::unique_lock<std::mutex> lock(request_mutex_);
+    auto request = pending_requests_.end();
+    if (correlated) {
+        request = pending_requests_.find(correlation_id);
+        if (request != pending_requests_.end() && !request->second.correlated) request = pending_requests_.end();
+    } else {
+        // Without correlation ids the oldest request for this command code gets the ack
+        request = std::find_if(pending_requests_.begin(), pending_requests_.end(), [&cmd](const auto &pending) {
+            return !pending.second.correlated && pending.second.command == cmd.command;
+        });
+    }
+    if (request == pending_requests_.end()) return false;
+    ReceiveCallback on_ack = std::move(request->second.on_ack);
+    if (request->second.deadline) request->second.deadline->cancel();
+    pending_requests_.erase(request);
+    num_pending_requests_--;
+    lock.unlock();
+    on_ack({}, std::move(cmd));
+    return true;
+}
+
+void TCPConnection::FailRequest(const uint32_t request_id, const asio::error_code &ec) {
+    std::unique_lock<std::mutex> lock(request_mutex_);
+    const auto request = pending_requests_.find(request_id);
+    if (request == pending_requests_.end()) return; // already completed
+    ReceiveCallback on_ack = std::move(request->second.on_ack);
+    if (request->second.deadline) request->second.deadline->cancel();
+    pending_requests_.erase(request);
+    num_pending_requests_--;
+    lock.unlock();
+    on_ack(ec, Command(0, 0));
+}
+
+void TCPConnection::AbortWaiters() {
+    std::deque<ReceiveCallback> recv_waiters;
+    std::map<uint32_t, PendingRequest> requests;
+    {
+        std::lock_guard<std::mutex> lock(recv_mutex_);
+        recv_waiters.swap(recv_waiters_);
+    }
+    {
+        std::lock_guard<std::mutex> lock(request_mutex_);
+        requests.swap(pending_requests_);
+        num_pending_requests_ = 0;
+    }
+    for (auto &waiter : recv_waiters) waiter(asio::error::operation_aborted, Command(0, 0));
+    for (auto &request : requests) {
+        if (request.second.deadline) request.second.deadline->cancel();
+        request.second.on_ack(asio::error::operation_aborted, Command(0, 0));
+    }
+}
+
+void TCPConnection::AbortSendBuffer() {
+    std::deque<SendEntry> dropped;
+    {
+        std::lock_guard<std::mutex> lock(send_mutex_);
+        dropped.swap(send_command_buffer_);
+        conflation_slots_.clear();
+        for (auto &queue : shaped_queues_) {
+            for (auto &shaped : queue) dropped.push_back(std::move(shaped.entry));
+            queue.clear();
+        }
+    }
+    for (auto &entry : dropped) {
+        if (entry.on_sent) entry.on_sent(asio::error::operation_aborted);
+    }
+}
+
+void TCPConnection::RegisterHandler(const uint16_t cmd, CommandHandler handler, const bool run_inline) {
+    if (handler_index_.empty()) handler_index_.resize(UINT16_MAX + 1, 0);
+    if (handler_index_[cmd] != 0) {
+        handlers_[handler_index_[cmd] - 1] = {std::move(handler), run_inline};
+        return;
+    }
+    handlers_.push_back({std::move(handler), run_inline});
+    handler_index_[cmd] = static_cast<uint32_t>(handlers_.size());
+}
+
+void TCPConnection::EnableLatestValue(const uint16_t cmd, const size_t max_args) {
+    if (latest_index_.empty()) latest_index_.resize(UINT16_MAX + 1, 0);
+    auto slot = std::make_unique<LatestSlot>(max_args);
+    if (latest_index_[cmd] != 0) {
+        latest_slots_[latest_index_[cmd] - 1] = std::move(slot);
+        return;
+    }
+    latest_slots_.push_back(std::move(slot));
+    latest_index_[cmd] = static_cast<uint32_t>(latest_slots_.size());
+}
+
+uint64_t TCPConnection::ReadLatest(const uint16_t cmd, Command &latest) const {
+    const LatestSlot *slot = FindLatest(cmd);
+    if (slot == nullptr) return 0;
+    while (true) {
+        const uint64_t begin = slot->sequence.load(std::memory_order_acquire);
+        if (begin == 0) return 0;
+        if (begin & 1) { // mid write, it is a short copy so just try again
+            std::this_thread::yield();
+            continue;
+        }
+        const uint32_t arg_count = slot->arg_count.load(std::memory_order_relaxed);
+        // arg_count can be torn by a concurrent write, the sequence check below discards that copy
+        latest.arguments.resize(std::min<size_t>(arg_count, slot->capacity));
+        for (size_t i = 0; i < latest.arguments.size(); i++) latest.arguments[i] = slot->words[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->sequence.load(std::memory_order_relaxed) == begin) {
+            latest.command = cmd;
+            return begin / 2;
+        }
+    }
+}
+
+void TCPConnection::ProcessCommand(Command &cmd) {
+    if (cmd.command == TCPProtocol::kCapabilities && cmd.arguments.size() == 2 &&
+        cmd.arguments[0] == TCPProtocol::kCapabilityMagic) {
+        // Answered before they take effect, so the client has ours before any frame using them
+        if (is_server_) QueueCapabilities();
+        peer_capabilities_ = cmd.arguments[1] & local_capabilities_;
+        // Sent first on every new connection, so the peer's encoder has just reset as well
+        decoder_.Reset();
+        reassembler_.Reset();
+        std::cout << "Negotiated capabilities [" << port_ << "] 0x" << std::hex << peer_capabilities_.load()
+                  << std::dec << std::endl;
+        return; // link control, never acked or delivered
+    }
+    // The envelopes are only unwrapped once negotiated, a legacy peer may use these codes for its own commands
+    const uint32_t negotiated = peer_capabilities_.load();
+    if (cmd.command == TCPProtocol::kBatch && (negotiated & TCPProtocol::kCapBatching)) {
+        std::vector<Command> cmds;
+        if (!TCPProtocol::Unbatch(cmd, cmds)) {
+            std::cerr << "Bad batch frame, dropped [" << port_ << "]" << std::endl;
+            return;
+        }
+        for (auto &batched : cmds) ProcessCommand(batched);
+        return;
+    }
+    // The message is handled as one command once its last fragment arrives
+    if (cmd.command == TCPProtocol::kFragment && (negotiated & TCPProtocol::kCapFragmentation) && !Reassemble(cmd)) return;
+    if (cmd.command == TCPProtocol::kCompressed && (negotiated & TCPProtocol::kCapCompression) && !decoder_.Decode(cmd)) {
+        std::cerr << "Bad compressed frame, dropped [" << port_ << "]" << std::endl;
+        return;
+    }
+    // Acked with the size of its own frame, not that of the batch, last fragment or compressed frame it came in
+    const size_t frame_bytes = TCPProtocol::FrameBytes(cmd);
+    uint32_t correlation_id = 0;
+    bool is_reply = false;
+    const bool correlated = (negotiated & TCPProtocol::kCapCorrelation) && TCPProtocol::Uncorrelate(cmd, correlation_id, is_reply);
+    const uint16_t cmd_code = cmd.command; // handlers may consume the command
+
+    // Acks for outstanding requests complete the request instead of being delivered
+    bool completed_request = false;
+    if (num_pending_requests_.load() > 0 && (!correlated || is_reply)) {
+        completed_request = CompleteRequest(cmd, correlated, correlation_id);
+    }
+    if (!completed_request) DeliverCommand(cmd);
+    if (!is_reply) SendAck(cmd_code, frame_bytes, correlated ? std::optional<uint32_t>(correlation_id) : std::nullopt);
+}
+
+bool TCPConnection::Reassemble(Command &cmd) {
+    switch (reassembler_.Add(cmd)) {
+        case Reassembler::kComplete:
+            return true;
+        case Reassembler::kMalformed:
+            std::cerr << "Bad fragment, dropped [" << port_ << "]" << std::endl;
+            break;
+        case Reassembler::kTooLarge:
+            std::cerr << "Message of " << cmd.arguments[3] << " args is too large, dropped [" << port_ << "]" << std::endl;
+            break;
+        case Reassembler::kOutOfSequence:
+            // Fragments only go missing if the link dropped, the rest of the message is discarded
+            std::cerr << "Out of sequence fragment, message dropped [" << port_ << "]" << std::endl;
+            break;
+        case Reassembler::kInterrupted:
+            std::cerr << "Incomplete message dropped [" << port_ << "]" << std::endl;
+            break;
+        default:
+            break;
+    }
+    return false;
+}
+
+void TCPConnection::SendAck(const uint16_t cmd, const size_t received_bytes, const std::optional<uint32_t> correlation_id) {
+    // Send an ack back after receiving a message, for client, command link only
+    // per specification the ack should be the command + num received bytes
+    if (is_server_ || monitor_link_) return;
+    Command ack(cmd, 1);
+    ack.arguments[0] = static_cast<uint32_t>(received_bytes);
+    if (!correlation_id) {
+        WriteSendBuffer(std::move(ack));
+        return;
+    }
+    QueueSend({TCPProtocol::Correlate(*correlation_id, std::move(ack), true), nullptr, ExpiryOf(cmd), nullptr, cmd});
+}
+
+void TCPConnection::SendCapabilities() {
+    peer_capabilities_ = 0;
+    if (!is_server_) QueueCapabilities();
+}
+
+void TCPConnection::QueueCapabilities() {
+    if (local_capabilities_ == 0) return;
+    Command capabilities(TCPProtocol::kCapabilities, 2);
+    capabilities.arguments = {TCPProtocol::kCapabilityMagic, local_capabilities_};
+    // Put it at the front so the peer learns what we support before any other command
+    std::unique_lock<std::mutex> lock(send_mutex_);
+    send_command_buffer_.push_front({std::move(capabilities), nullptr, std::chrono::steady_clock::time_point::max(),
+                                     nullptr, TCPProtocol::kCapabilities});
+    WakeSimSender();
+    lock.unlock();
+    send_cmd_available_.notify_one();
+}
+
+// Called holding send_mutex_ once a command is queued. A conflated command replaced where it was held
+// back gives the send thread nothing to do, so it stays blocked
+void TCPConnection::WakeSimSender() {
+    if (!sim_send_blocked_) return;
+    if (send_command_buffer_.empty() && !shaping_release_ && !stop_cmd_write_.load() && !stop_server_.load()) return;
+    sim_send_blocked_ = false;
+    sim_->Unblock();
+}
+
+void TCPConnection::DeliverCommand(Command &cmd) {
+    LatestSlot *slot = FindLatest(cmd.command);
+    if (slot && cmd.arguments.size() <= slot->capacity) {
+        const uint64_t sequence = slot->sequence.load(std::memory_order_relaxed);
+        slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot->arg_count.store(static_cast<uint32_t>(cmd.arguments.size()), std::memory_order_relaxed);
+        for (size_t i = 0; i < cmd.arguments.size(); i++) slot->words[i].store(cmd.arguments[i], std::memory_order_relaxed);
+        slot->sequence.store(sequence + 2, std::memory_order_release);
+        return;
+    }
+    const HandlerEntry *entry = FindHandler(cmd.command);
+    if (entry && entry->run_inline) {
+        entry->handler(cmd);
+        return;
+    }
+    if (Publish(cmd)) return;
+    WriteRecvBuffer(cmd);
+    cmd_available_.notify_all();
+}
+
+std::shared_ptr<Subscription> TCPConnection::Subscribe(const uint16_t first, const uint16_t last, const size_t capacity) {
+    subscriptions_.push_back(std::make_shared<Subscription>(first, last, nullptr, capacity));
+    return subscriptions_.back();
+}
+
+std::shared_ptr<Subscription> TCPConnection::Subscribe(Subscription::Predicate predicate, const size_t capacity) {
+    subscriptions_.push_back(std::make_shared<Subscription>(0, UINT16_MAX, std::move(predicate), capacity));
+    return subscriptions_.back();
+}
+
+bool TCPConnection::Publish(Command &cmd) {
+    // The command is only moved into a shared frame once the first subscriber wants it
+    Subscription::Ptr shared;
+    for (const auto &subscription : subscriptions_) {
+        if (subscription->IsClosed() || !subscription->Matches(shared ? *shared : cmd)) continue;
+        if (!shared) shared = std::make_shared<const Command>(std::move(cmd));
+        subscription->Push(shared);
+    }
+    return shared != nullptr;
+}
+
+std::vector<Command> TCPConnection::DispatchRecvBuffer() {
+    // Take the whole buffer in one go so the io thread isn't held off while handlers run
+    std::deque<Command> pending;
+    {
+        std::lock_guard<std::mutex> lock(recv_mutex_);
+        pending.swap(recv_command_buffer_);
+        ClearRecvNotify();
+    }
+    std::vector<Command> unhandled;
+    for (auto &cmd : pending) {
+        if (const HandlerEntry *entry = FindHandler(cmd.command)) {
+            entry->handler(cmd);
+        } else {
+            unhandled.push_back(std::move(cmd));
+        }
+    }
+    return unhandled;
+}
+
+int TCPConnection::GetRecvNotifyFd() {
+    std::lock_guard<std::mutex> lock(recv_mutex_);
+    if (recv_notify_fd_ < 0) {
+        recv_notify_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (recv_notify_fd_ < 0) {
+            std::cerr << "Failed to create receive notify eventfd!" << std::endl;
+            return recv_notify_fd_;
+        }
+        // Commands may have arrived before anyone asked for the fd
+        if (!recv_command_buffer_.empty()) SignalRecvNotify();
+    }
+    return recv_notify_fd_;
+}
+
+std::vector<size_t> TCPConnection::WaitAny(const std::vector<std::shared_ptr<TCPConnection>> &connections,
+                                           const std::chrono::milliseconds timeout) {
+    ConnectionPoller poller(connections);
+    return poller.Wait(timeout);
+}
+
+void TCPConnection::SignalRecvNotify() {
+    if (recv_notify_fd_ < 0) return;
+    const uint64_t one = 1;
+    if (write(recv_notify_fd_, &one, sizeof(one)) != sizeof(one)) {
+        if (debug_flag_) std::cerr << "Failed to signal receive notify eventfd" << std::endl;
+    }
+}
+
+void TCPConnection::ClearRecvNotify() {
+    if (recv_notify_fd_ < 0 || !recv_command_buffer_.empty()) return;
+    // Reading an eventfd resets its counter, so it stops polling readable
+    uint64_t count;
+    if (read(recv_notify_fd_, &count, sizeof(count)) != sizeof(count)) {
+        if (debug_flag_) std::cerr << "Receive notify eventfd was not set" << std::endl;
+    }
 }
 
 // Current function 09/16
 void TCPConnection::SendData() {
+    ThreadControl::Scope scope("send", port_);
     if (debug_flag_) std::cout << stop_cmd_write_.load() << "/" << stop_server_.load()  << std::endl;
+    // A new send thread is started for each connection, so the zero copy state starts fresh with the socket
+    zerocopy_enabled_ = zerocopy_min_bytes_ > 0 && !shm_ && !sim_ && !udp_socket_ && EnableZeroCopy();
+    zerocopy_next_seq_ = 0;
+    zerocopy_pending_.clear();
+    encoder_.Reset();
+    // Small commands queued together are moved here and packed into one frame
+    std::vector<Command> batch;
     while (!stop_server_.load() && !stop_cmd_write_.load()) {
         std::unique_lock<std::mutex> lock(send_mutex_);
         auto self = shared_from_this();
-        send_cmd_available_.wait(lock, [this, self] {
-        return !send_command_buffer_.empty() || stop_cmd_write_.load() || stop_server_.load();
-        });
+        auto ready = [this, self] {
+            return !send_command_buffer_.empty() || shaping_release_ || stop_cmd_write_.load() || stop_server_.load();
+        };
+        if (sim_ && !ready()) {
+            // Blocked until a command is queued, the link's clock may move on meanwhile
+            sim_send_blocked_ = true;
+            sim_->Block();
+            send_cmd_available_.wait(lock, ready);
+            WakeSimSender();
+        } else if (zerocopy_pending_.empty()) {
+            send_cmd_available_.wait(lock, ready);
+        } else if (!send_cmd_available_.wait_for(lock, std::chrono::milliseconds(10), ready)) {
+            // Idle with zero copy buffers outstanding, release the completed ones
+            lock.unlock();
+            ReapZeroCopy();
+            continue;
+        }
         if (stop_cmd_write_.load() || stop_server_.load()) break; // just an extra catch
 
-        // Construct the TCP packet which will be deserialized and sent.
-        TCPProtocol packet(send_command_buffer_.front().command,
-                           send_command_buffer_.front().arguments.size()); // cmd, vec.size
-        packet.arguments = std::move(send_command_buffer_.front().arguments);
-        std::vector<uint8_t> buffer = packet.Serialize();
-        send_command_buffer_.pop_front();
+        SendEntry entry{Command(0, 0), nullptr};
+        size_t traffic_class = 0;
+        const auto now = std::chrono::steady_clock::now();
+        bool found = false;
+        // Commands still held back when the last rate was removed go first, through the shaper
+        if (!shaper_.Enabled() && !HeldBack()) {
+            shaping_release_ = false;
+            while (!found && !send_command_buffer_.empty()) {
+                ReleaseConflation(send_command_buffer_.front());
+                entry = std::move(send_command_buffer_.front());
+                send_command_buffer_.pop_front();
+                found = !Expired(entry, now);
+            }
+        } else {
+            found = NextShapedEntry(entry, traffic_class, now);
+        }
+        if (!found) {
+            // Everything queued had expired or is waiting for tokens
+            lock.unlock();
+            RunExpiredCallbacks();
+            continue;
+        }
+        if (entry.frame) {
+            lock.unlock();
+            RunExpiredCallbacks();
+            if (shaper_.Enabled()) {
+                std::lock_guard<std::mutex> shaper_lock(send_mutex_);
+                shaper_.Consume(traffic_class, entry.frame->size());
+            }
+            SendFrame(entry.frame, std::move(entry.on_sent));
+            continue;
+        }
+        Command command = std::move(entry.command);
+        SendCallback on_sent = std::move(entry.on_sent);
+        // Small commands which queued up behind this one go out with it in one kBatch frame. When
+        // shaping, only those of the same class which aren't behind held back commands of their own
+        auto batch_next = [this, traffic_class]() {
+            if (send_command_buffer_.empty() || send_command_buffer_.front().frame ||
+                !Batchable(send_command_buffer_.front().command)) return false;
+            return !shaper_.Enabled() || (traffic_class < TrafficShaper::kNumClasses && shaped_queues_[traffic_class].empty() &&
+                                          TrafficClass(send_command_buffer_.front().code) == traffic_class);
+        };
+        batch.clear();
+        if ((peer_capabilities_.load() & TCPProtocol::kCapBatching) && Batchable(command) && batch_next()) {
+            std::vector<SendCallback> callbacks;
+            if (on_sent) callbacks.push_back(std::move(on_sent));
+            batch.push_back(std::move(command));
+            while (batch.size() < TCPProtocol::kMaxBatchCommands && batch_next()) {
+                SendEntry &next = send_command_buffer_.front();
+                ReleaseConflation(next);
+                if (Expired(next, now)) {
+                    send_command_buffer_.pop_front();
+                    continue;
+                }
+                batch.push_back(std::move(next.command));
+                if (next.on_sent) callbacks.push_back(std::move(next.on_sent));
+                send_command_buffer_.pop_front();
+            }
+            if (!callbacks.empty()) {
+                on_sent = [callbacks = std::move(callbacks)](const asio::error_code &ec) {
+                    for (auto &callback : callbacks) callback(ec);
+                };
+            }
+            if (batch.size() == 1) { // the rest had expired
+                command = std::move(batch.front());
+                batch.clear();
+            }
+        }
         lock.unlock();
-        asio::socket_base::send_buffer_size option_send;
-        socket_.get_option(option_send);
-        int send_buffer_size = option_send.value();
-        async_write(socket_, asio::buffer(buffer), [this, self](const asio::error_code &ec,
-                                                                            const std::size_t &bytes_sent) {
-            if (!ec) {
-                // if (debug_flag_)
-                // std::cout << "Sent: " << bytes_sent << "B" << std::endl;
+        RunExpiredCallbacks();
+
+        const bool compress = peer_capabilities_.load() & TCPProtocol::kCapCompression;
+        const bool fragment = peer_capabilities_.load() & TCPProtocol::kCapFragmentation;
+        // Encoding moves the code's reference on, so only encode commands which will go out or the
+        // peer's reference falls behind. The envelope can push a full frame over the limit, send those plain
+        auto sendable = [fragment](const size_t num_args) {
+            return num_args <= TCPProtocol::kMaxFrameArgs || (fragment && num_args <= TCPProtocol::kMaxMessageArgs);
+        };
+        if (!batch.empty()) {
+            for (auto &cmd : batch) {
+                if (compress && compressed_codes_[cmd.command]) encoder_.Encode(cmd);
+            }
+            command = TCPProtocol::Batch(batch);
+        } else if (compress && compressed_codes_[command.command] &&
+                   sendable(command.arguments.size() + DeltaCodec::kEnvelopeWords)) {
+            encoder_.Encode(command);
+        }
+        if (shaper_.Enabled()) {
+            // Charge the bytes about to go on the wire, including the framing of any fragments
+            const size_t num_frames = command.arguments.size() / TCPProtocol::kMaxFragmentArgs + 1;
+            const size_t frame_bytes = command.arguments.size() * sizeof(uint32_t) +
+                num_frames * (TCPProtocol::header_size_ + TCPProtocol::footer_size_);
+            std::lock_guard<std::mutex> shaper_lock(send_mutex_);
+            shaper_.Consume(traffic_class, frame_bytes);
+        }
+        if (command.arguments.size() > TCPProtocol::kMaxFrameArgs) {
+            if (sendable(command.arguments.size())) {
+                SendFragments(command, std::move(on_sent));
             } else {
-                // if (debug_flag_)
-                std::cerr << "Send error: " << ec.message() << "\n";
-                send_command_buffer_.clear();
-                // if (client_connected_) restart_client_.store(true); //FIXME add something here
+                std::cerr << "Command " << command.command << " has " << command.arguments.size()
+                          << " args, too many for one frame without fragmentation or for the peer to reassemble" << std::endl;
+                if (on_sent) on_sent(asio::error::message_size);
             }
-        });
+            continue;
+        }
+        // Construct the TCP packet which will be deserialized and sent.
+        TCPProtocol packet(command.command, command.arguments.size()); // cmd, vec.size
+        packet.arguments = std::move(command.arguments);
+        // The buffer has to stay alive until the write completes, so it is owned by the handler
+        SendFrame(std::make_shared<std::vector<uint8_t>>(packet.Serialize()), std::move(on_sent));
         // slock.unlock();
     }
     if (debug_flag_) std::cout << "Exit SendData" << std::endl;
+    send_thread_exited_.store(true);
+}
+
+// Called by the send thread holding send_mutex_. Returns the next command the shaper lets through, moving
+// the ones it holds back to their class queue, or false with the timer armed if none can go yet
+bool TCPConnection::NextShapedEntry(SendEntry &entry, size_t &traffic_class, const TrafficShaper::Clock::time_point now) {
+    shaping_release_ = false;
+    // Commands held back earlier go before anything new of their class
+    for (size_t cls = 0; cls < TrafficShaper::kNumClasses; cls++) {
+        std::deque<ShapedEntry> &queue = shaped_queues_[cls];
+        while (!queue.empty() && Expired(queue.front().entry, now)) {
+            ReleaseConflation(queue.front().entry);
+            queue.pop_front();
+        }
+        if (queue.empty() || !shaper_.Ready(cls, now)) continue;
+        shaper_.RecordDelay(cls, now - queue.front().queued);
+        ReleaseConflation(queue.front().entry);
+        entry = std::move(queue.front().entry);
+        queue.pop_front();
+        traffic_class = cls;
+        // Come back for the rest without waiting on the timer, they may have tokens too
+        shaping_release_ = true;
+        return true;
+    }
+    while (!send_command_buffer_.empty()) {
+        SendEntry &next = send_command_buffer_.front();
+        if (Expired(next, now)) {
+            ReleaseConflation(next);
+            send_command_buffer_.pop_front();
+            continue;
+        }
+        const uint16_t code = next.code;
+        const size_t cls = code == TCPProtocol::kHeartBeat || code == TCPProtocol::kCapabilities
+            ? TrafficShaper::kControlClass : TrafficClass(code);
+        if (cls == TrafficShaper::kControlClass || (shaped_queues_[cls].empty() && shaper_.Ready(cls, now))) {
+            shaper_.RecordDelay(cls, TrafficShaper::Clock::duration::zero());
+            ReleaseConflation(next);
+            entry = std::move(next);
+            send_command_buffer_.pop_front();
+            traffic_class = cls;
+            return true;
+        }
+        // A conflated command stays replaceable while it is held back
+        const bool conflated = ReleaseConflation(next);
+        shaped_queues_[cls].push_back({std::move(next), now});
+        if (conflated) conflation_slots_[code] = &shaped_queues_[cls].back().entry;
+        send_command_buffer_.pop_front();
+    }
+    ArmShapingTimer(now);
+    return false;
+}
+
+// Wake the send thread when the first held back class has tokens again. The timer is only touched on
+// the io thread, a timer which is already due earlier is left alone
+void TCPConnection::ArmShapingTimer(const TrafficShaper::Clock::time_point now) {
+    auto release = TrafficShaper::Clock::time_point::max();
+    for (size_t cls = 0; cls < TrafficShaper::kNumClasses; cls++) {
+        if (!shaped_queues_[cls].empty()) release = std::min(release, shaper_.ReadyAt(cls, now));
+    }
+    if (release == TrafficShaper::Clock::time_point::max()) return;
+    if (shaping_deadline_ != TrafficShaper::Clock::time_point{} && shaping_deadline_ <= release) return;
+    shaping_deadline_ = release;
+    auto self = shared_from_this();
+    asio::post(shaping_timer_.get_executor(), [this, self, release]() {
+        shaping_timer_.expires_at(release);
+        shaping_timer_.async_wait([this, self](const asio::error_code &ec) {
+            if (ec) return; // replaced by an earlier release
+            {
+                std::lock_guard<std::mutex> lock(send_mutex_);
+                shaping_release_ = true;
+                shaping_deadline_ = {};
+            }
+            send_cmd_available_.notify_one();
+        });
+    });
+}
+
+// Called holding send_mutex_. Queues the entry, or writes it over the unsent command of its code in place
+// if the code is conflated, returning the callback of the command it replaced
+SendCallback TCPConnection::Conflate(SendEntry &entry) {
+    const uint16_t code = entry.code;
+    if (!conflated_codes_[code]) {
+        send_command_buffer_.push_back(std::move(entry));
+        return nullptr;
+    }
+    auto slot = conflation_slots_.find(code);
+    if (slot == conflation_slots_.end()) {
+        send_command_buffer_.push_back(std::move(entry));
+        conflation_slots_.emplace(code, &send_command_buffer_.back());
+        return nullptr;
+    }
+    conflated_counts_[code]++;
+    SendCallback superseded = std::move(slot->second->on_sent);
+    *slot->second = std::move(entry);
+    return superseded;
+}
+
+// Called holding send_mutex_ before an entry leaves its queue, true if it was the conflation slot of its code
+bool TCPConnection::ReleaseConflation(const SendEntry &entry) {
+    if (conflation_slots_.empty()) return false;
+    const auto slot = conflation_slots_.find(entry.code);
+    if (slot == conflation_slots_.end() || slot->second != &entry) return false;
+    conflation_slots_.erase(slot);
+    return true;
+}
+
+std::map<uint16_t, uint64_t> TCPConnection::GetConflatedCounts() {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    return conflated_counts_;
+}
+
+std::chrono::steady_clock::time_point TCPConnection::ExpiryOf(const uint16_t cmd) const {
+    if (max_queue_ages_.empty() || max_queue_ages_[cmd].count() == 0) return std::chrono::steady_clock::time_point::max();
+    return std::chrono::steady_clock::now() + max_queue_ages_[cmd];
+}
+
+// Called by the send thread holding send_mutex_ for each command it takes off a queue
+bool TCPConnection::Expired(SendEntry &entry, const std::chrono::steady_clock::time_point now) {
+    if (entry.expires > now) return false;
+    expired_counts_[entry.code]++;
+    if (debug_flag_) std::cout << "Expired cmd: " << entry.code << std::endl;
+    if (entry.on_sent) expired_callbacks_.push_back(std::move(entry.on_sent));
+    return true;
+}
+
+void TCPConnection::RunExpiredCallbacks() {
+    for (auto &callback : expired_callbacks_) callback(asio::error::timed_out);
+    expired_callbacks_.clear();
+}
+
+void TCPConnection::SetMaxQueueAge(const uint16_t cmd, const std::chrono::milliseconds max_age) {
+    if (max_queue_ages_.empty()) max_queue_ages_.resize(UINT16_MAX + 1, std::chrono::milliseconds(0));
+    max_queue_ages_[cmd] = max_age;
+}
+
+std::map<uint16_t, uint64_t> TCPConnection::GetExpiredCounts() {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    return expired_counts_;
+}
+
+size_t TCPConnection::TrafficClass(const uint16_t cmd) const {
+    return traffic_classes_.empty() ? 0 : traffic_classes_[cmd];
+}
+
+void TCPConnection::SetTrafficClass(const uint16_t cmd, const uint8_t traffic_class) {
+    if (traffic_class >= TrafficShaper::kNumClasses) {
+        throw std::out_of_range("Traffic class must be below " + std::to_string(TrafficShaper::kNumClasses));
+    }
+    if (traffic_classes_.empty()) traffic_classes_.resize(UINT16_MAX + 1, 0);
+    traffic_classes_[cmd] = traffic_class;
+}
+
+TCPConnection::ShapingStats TCPConnection::GetShapingStats(const uint8_t traffic_class) {
+    if (traffic_class > TrafficShaper::kControlClass) {
+        throw std::out_of_range("Traffic class must be below " + std::to_string(TrafficShaper::kNumClasses) +
+                                " or the control class " + std::to_string(TrafficShaper::kControlClass));
+    }
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    const TrafficShaper::Stats stats = shaper_.GetStats(traffic_class);
+    const size_t queued = traffic_class < TrafficShaper::kNumClasses ? shaped_queues_[traffic_class].size() : 0;
+    return {stats.frames, stats.delayed, stats.mean_delay_ms, stats.max_delay_ms, queued};
+}
+
+void TCPConnection::SetLinkRate(const double bytes_per_sec, const double burst_bytes) {
+    std::unique_lock<std::mutex> lock(send_mutex_);
+    shaper_.SetLinkRate(bytes_per_sec, burst_bytes);
+    ReleaseShaped(lock);
+}
+
+void TCPConnection::SetClassRate(const uint8_t traffic_class, const double bytes_per_sec, const double burst_bytes) {
+    std::unique_lock<std::mutex> lock(send_mutex_);
+    shaper_.SetClassRate(traffic_class, bytes_per_sec, burst_bytes);
+    ReleaseShaped(lock);
+}
+
+// Called holding send_mutex_ after a rate changed, the send thread looks at the held back commands again
+void TCPConnection::ReleaseShaped(std::unique_lock<std::mutex> &lock) {
+    if (!HeldBack()) return;
+    shaping_release_ = true;
+    WakeSimSender();
+    lock.unlock();
+    send_cmd_available_.notify_one();
+}
+
+bool TCPConnection::HeldBack() const {
+    return std::any_of(shaped_queues_.begin(), shaped_queues_.end(), [](const auto &queue) { return !queue.empty(); });
+}
+
+void TCPConnection::SendFrame(const std::shared_ptr<const std::vector<uint8_t>> &buffer, SendCallback on_sent) {
+    if (udp_socket_) {
+        // Losses are expected here, report them to the caller without tearing down the link
+        const asio::error_code ec = SendDatagram(*buffer);
+        if (ec && debug_flag_) std::cerr << "Datagram send error: " << ec.message() << "\n";
+        if (on_sent) on_sent(ec);
+        return;
+    }
+    if (shm_) {
+        asio::error_code ec;
+        if (!shm_->Write(buffer->data(), buffer->size(), stop_server_)) ec = asio::error::operation_aborted;
+        if (on_sent) on_sent(ec);
+        return;
+    }
+    if (sim_) {
+        asio::error_code ec;
+        const auto direction = is_server_ ? SimLink::kToClient : SimLink::kToServer;
+        if (!sim_->Write(direction, buffer->data(), buffer->size(), sim_session_.load())) ec = asio::error::connection_reset;
+        if (on_sent) on_sent(ec);
+        return;
+    }
+    // One write at a time, concurrent async_writes on a socket can interleave their partial
+    // writes and a zero copy send has to follow the frames queued before it
+    WaitForWrites();
+    if (zerocopy_enabled_ && buffer->size() >= zerocopy_min_bytes_) {
+        asio::error_code ec;
+        SendZeroCopy(buffer, ec);
+        if (ec) {
+            std::cerr << "Send error: " << ec.message() << "\n";
+            AbortSendBuffer();
+        }
+        if (on_sent) on_sent(ec);
+        return;
+    }
+    if (!zerocopy_pending_.empty()) ReapZeroCopy();
+
+    {
+        std::lock_guard<std::mutex> wlock(write_mutex_);
+        writes_in_flight_++;
+    }
+    auto self = shared_from_this();
+    async_write(socket_, asio::buffer(*buffer), [this, self, buffer, on_sent](const asio::error_code &ec,
+                                                                        const std::size_t &bytes_sent) {
+        if (!ec) {
+            if (debug_flag_) std::cout << "Sent: " << bytes_sent << "B" << std::endl;
+        } else {
+            // if (debug_flag_)
+            std::cerr << "Send error: " << ec.message() << "\n";
+            // A cancelled write means the link is being restarted, which decides what happens to the queue
+            if (ec != asio::error::operation_aborted) AbortSendBuffer();
+            // if (client_connected_) restart_client_.store(true); //FIXME add something here
+        }
+        {
+            std::lock_guard<std::mutex> wlock(write_mutex_);
+            writes_in_flight_--;
+        }
+        write_done_.notify_one();
+        if (on_sent) on_sent(ec);
+    });
+}
+
+// Split a command which is too large for one frame into kFragment frames. Each fragment is serialized
+// and written in turn, so only one frame sized buffer exists at a time instead of a copy of the message
+void TCPConnection::SendFragments(const Command &cmd, SendCallback on_sent) {
+    const uint32_t message_id = next_message_id_++;
+    const size_t total = cmd.arguments.size();
+    size_t offset = 0;
+    for (uint32_t index = 0; offset < total; index++) {
+        if (stop_server_.load() || stop_cmd_write_.load()) {
+            if (on_sent) on_sent(asio::error::operation_aborted);
+            return;
+        }
+        Command fragment = TCPProtocol::Fragment(cmd, message_id, index);
+        TCPProtocol packet(fragment.command, fragment.arguments.size());
+        packet.arguments = std::move(fragment.arguments);
+        offset += packet.arguments.size() - TCPProtocol::kFragmentHeaderWords;
+        // The caller hears about the message once its last fragment is written
+        SendFrame(std::make_shared<std::vector<uint8_t>>(packet.Serialize()), offset == total ? std::move(on_sent) : nullptr);
+    }
+}
+
+void TCPConnection::WaitForWrites() {
+    std::unique_lock<std::mutex> wlock(write_mutex_);
+    // Poll the stop flags too, a stopped io_context never runs the outstanding handlers
+    while (writes_in_flight_ > 0 && !stop_cmd_write_.load() && !stop_server_.load()) {
+        write_done_.wait_for(wlock, std::chrono::milliseconds(100));
+    }
+}
+
+bool TCPConnection::EnableZeroCopy() {
+    int enable = 1;
+    if (setsockopt(socket_.native_handle(), SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0) return true;
+    std::cerr << "SO_ZEROCOPY not supported, using normal sends [" << port_ << "]" << std::endl;
+    return false;
+}
+
+void TCPConnection::SendZeroCopy(const std::shared_ptr<const std::vector<uint8_t>> &buffer, asio::error_code &ec) {
+    const int fd = socket_.native_handle();
+    int flags = MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL;
+    size_t offset = 0;
+    while (offset < buffer->size()) {
+        if (stop_cmd_write_.load() || stop_server_.load()) {
+            ec = asio::error::operation_aborted;
+            return;
+        }
+        const ssize_t sent = send(fd, buffer->data() + offset, buffer->size() - offset, flags);
+        if (sent >= 0) {
+            // Only successful zero copy sends take a sequence number
+            if (flags & MSG_ZEROCOPY) zerocopy_pending_.emplace_back(zerocopy_next_seq_++, buffer);
+            offset += sent;
+        } else if (errno == ENOBUFS) {
+            // Over the locked memory limit for pinned pages, copy the rest of this frame
+            flags &= ~MSG_ZEROCOPY;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // Socket buffer is full, completions free it up so release what we can while waiting
+            ReapZeroCopy();
+            pollfd pfd{fd, POLLOUT, 0};
+            poll(&pfd, 1, 100);
+        } else if (errno != EINTR) {
+            ec = asio::error_code(errno, asio::error::get_system_category());
+            return;
+        }
+    }
+}
+
+void TCPConnection::ReapZeroCopy() {
+    const int fd = socket_.native_handle();
+    std::array<char, 128> control{};
+    while (!zerocopy_pending_.empty()) {
+        msghdr msg{};
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return; // nothing completed yet
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) continue;
+            const auto *err = reinterpret_cast<const sock_extended_err *>(CMSG_DATA(cmsg));
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            // The kernel had to copy the data anyway, pinning pages only adds overhead so stop asking
+            if ((err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && zerocopy_enabled_) {
+                std::cout << "Zero copy sends are being copied by the kernel, using normal sends [" << port_ << "]" << std::endl;
+                zerocopy_enabled_ = false;
+            }
+            // TCP completes sends in order, ee_info to ee_data is the inclusive range of sequence numbers
+            while (!zerocopy_pending_.empty() &&
+                   static_cast<int32_t>(zerocopy_pending_.front().first - err->ee_data) <= 0) {
+                zerocopy_pending_.pop_front();
+            }
+        }
+    }
 }
 
 Command TCPConnection::DecodeRawPacket(std::vector<uint8_t>& raw_buff) {
@@ -503,3 +1917,35 @@ Command TCPConnection::DecodeRawPacket(std::vector<uint8_t>& raw_buff) {
     }
     return cmd_buffer;
 }
+
+ConnectionPoller::ConnectionPoller(const std::vector<std::shared_ptr<TCPConnection>> &connections)
+    : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+      connections_(connections) {
+    if (epoll_fd_ < 0) {
+        throw std::runtime_error("Failed to create epoll instance");
+    }
+    // The notify fds are level triggered, they stay readable until the receive buffer is drained
+    for (size_t i = 0; i < connections_.size(); i++) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = i;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, connections_.at(i)->GetRecvNotifyFd(), &event) < 0) {
+            close(epoll_fd_);
+            throw std::runtime_error("Failed to add connection to epoll set");
+        }
+    }
+}
+
+ConnectionPoller::~ConnectionPoller() {
+    close(epoll_fd_);
+}
+
+std::vector<size_t> ConnectionPoller::Wait(const std::chrono::milliseconds timeout) {
+    std::vector<epoll_event> events(connections_.size());
+    std::vector<size_t> ready;
+    if (events.empty()) return ready;
+    const int num_ready = epoll_wait(epoll_fd_, events.data(), static_cast<int>(events.size()),
+                                     static_cast<int>(timeout.count()));
+    for (int i = 0; i < num_ready; i++) ready.push_back(events.at(i).data.u64);
+    return ready;
+}
@@ -8,37 +8,260 @@
 #include <optional>
 #include <condition_variable>
 #include <thread>
+#include <functional>
+#include <future>
+#include <map>
+#include <bitset>
+#include <unordered_map>
 #include "tcp_protocol.h"
+#include "tcp_codec.h"
+#include "tcp_shaper.h"
+#include "tcp_shm_transport.h"
+#include "tcp_sim_transport.h"
+#include "tcp_subscription.h"
+#include "tcp_threads.h"
 
 using asio::ip::tcp;
 
+// Handlers are passed the received command and may move its arguments out
+using CommandHandler = std::function<void(Command&)>;
+// Completion callbacks for the asynchronous send/receive interface
+using SendCallback = std::function<void(const asio::error_code&)>;
+using ReceiveCallback = std::function<void(const asio::error_code&, Command)>;
+
 class TCPConnection : public std::enable_shared_from_this<TCPConnection>, public Command {
 public:
+    // ip_address is an IPv4/IPv6 address, or "unix:<path>" for a unix domain socket at <path>.<port>
+    // so co-located processes skip the TCP stack. "unix:@<name>" uses the abstract namespace, which
+    // leaves no socket file behind. "shm:<name>" exchanges frames through the shared memory segment
+    // /<name>.<port> without any system calls while the link is busy, see ShmTransport. Shared memory
+    // links have no heartbeat and inline handlers run on their receive thread instead of the io thread.
+    // Monitor links may use "udp:<ip>", see GetDatagramStats(). "sim:<name>" links the two ends in this
+    // process over the SimLink "<name>.<port>", which can add latency, bandwidth limits, corruption
+    // and disconnects on a virtual clock for testing. Heartbeats, read timeouts and reconnects run on
+    // the link's clock
     TCPConnection(asio::io_context& io_context, const std::string& ip_address,
         uint16_t port, bool is_server, bool use_heartbeat, bool monitor_link);
     ~TCPConnection();
 
-    std::deque<Command> send_command_buffer_;
+    // A queued command and the optional callback to run once it is written to the socket. Commands still
+    // queued at their expiry time are dropped by the send thread instead of being sent. Broadcasts carry
+    // their already serialized frame, shared by every connection, and only the code in command. code is
+    // the command's own code, which the queues go by, as command may be its kCorrelated envelope
+    using Frame = std::shared_ptr<const std::vector<uint8_t>>;
+    struct SendEntry {
+        Command command;
+        SendCallback on_sent;
+        std::chrono::steady_clock::time_point expires{std::chrono::steady_clock::time_point::max()};
+        Frame frame{};
+        uint16_t code{0};
+    };
+    std::deque<SendEntry> send_command_buffer_;
     std::deque<Command> recv_command_buffer_;
 
     // Interface to send/receive commands and data
     void Start();
     void WriteSendBuffer(uint16_t cmd, std::vector<uint32_t> &vec);
     void WriteSendBuffer(const Command& cmd_struct);
+    void WriteSendBuffer(Command&& cmd_struct);
+    // Queue a burst of commands with a single lock and consumer wakeup, the commands are moved out of cmds
+    void WriteSendBuffer(std::vector<Command> &cmds);
+    // Callback style asynchronous interface, the callbacks run on the io or send thread (or the calling
+    // thread if the result is already available) and get operation_aborted if the link is stopped.
+    // on_sent is called once the command has been written to the socket
+    void WriteSendBuffer(Command&& cmd_struct, SendCallback on_sent);
+    // Send the command only if it reaches the front of the queue before expires, otherwise it is dropped,
+    // counted in GetExpiredCounts() and on_sent gets timed_out. Overrides any SetMaxQueueAge() of the code
+    void WriteSendBuffer(Command&& cmd_struct, std::chrono::steady_clock::time_point expires, SendCallback on_sent = nullptr);
+    // Drop commands of this code which waited longer than max_age to be sent, eg. setpoints and status
+    // snapshots which are stale by then. Checked as commands leave the queue, 0 disables. Set before Start()
+    void SetMaxQueueAge(uint16_t cmd, std::chrono::milliseconds max_age);
+    // Commands dropped at their expiry so far, by command code
+    std::map<uint16_t, uint64_t> GetExpiredCounts();
+    // Conflate the sends of this code: a new command replaces the one still waiting in the queue, if
+    // there is one, in place and keeping its position, so only the latest state goes out and the queue
+    // holds at most one command per conflated code. The replaced command's on_sent gets operation_aborted.
+    // Don't use for requests without correlation ids, each one expects its own ack. Set before Start()
+    void EnableConflation(const uint16_t cmd) { conflated_codes_.set(cmd); }
+    // Commands replaced before being sent so far, by command code
+    std::map<uint16_t, uint64_t> GetConflatedCounts();
+    // Called with the next received command, without blocking the calling thread
+    void ReadRecvBuffer(ReceiveCallback callback);
+    // Send a command and call on_ack with the peer's acknowledgement, the reply with the same command code.
+    // Any number of requests may be in flight. If the peer supports correlation ids (kCapCorrelation) each
+    // ack is matched to its request by id, otherwise acks are matched by command code in send order.
+    // A request without an ack after the timeout fails with timed_out, kNoTimeout waits forever
+    static constexpr std::chrono::milliseconds kNoTimeout{0};
+    void SendRequest(Command&& cmd_struct, ReceiveCallback on_ack, std::chrono::milliseconds timeout = kNoTimeout);
+    std::future<Command> SendRequest(Command&& cmd_struct, std::chrono::milliseconds timeout = kNoTimeout);
+
+    // Queue the same command on each of the connections. It is serialized once into an immutable frame
+    // which every send queue shares, so each extra connection only costs a reference and its write.
+    // The frame is sent as is, without the per link extensions (compression, correlation, batching).
+    // Commands too large for one frame are queued on each connection separately
+    static void Broadcast(const Command &cmd, const std::vector<std::shared_ptr<TCPConnection>> &connections);
+
+    // Opt in to optional protocol extensions (TCPProtocol::kCap* bits). The client advertises them on
+    // connect and the server answers with its own, an extension is only used once both sides have it, so
+    // peers which don't know about them keep getting the standard frames. A legacy client never sees the
+    // exchange, a legacy server gets the client's kCapabilities frame as an ordinary command. Until an
+    // extension is negotiated its codes (kBatch, kFragment, ...) are delivered as ordinary commands. With kCapFragmentation commands with more than TCPProtocol::kMaxFrameArgs
+    // args are split into kFragment frames and delivered whole at the other end, without it they fail with
+    // message_size. With kCapBatching small commands which queue up while the link is busy share one kBatch
+    // frame. Set before Start()
+    void SetCapabilities(const uint32_t capabilities) { local_capabilities_ = capabilities; }
+    uint32_t GetPeerCapabilities() const { return peer_capabilities_.load(); }
+    // Delta compress the frames of this code (see DeltaCodec) once both ends have kCapCompression.
+    // Datagram links never negotiate capabilities so they always send plain frames. Set before Start()
+    void EnableCompression(const uint16_t cmd) { compressed_codes_.set(cmd); }
+
+    // Send frames of at least min_bytes with MSG_ZEROCOPY, the kernel transmits straight from the
+    // serialized buffer, which is held until the completion arrives on the socket error queue.
+    // Smaller frames use normal sends, as does every frame if the kernel reports it had to copy
+    // anyway (eg. loopback). 0 disables, set before Start()
+    void SetZeroCopy(const size_t min_bytes) { zerocopy_min_bytes_ = min_bytes; }
+    // Token bucket shaping of the send pipeline, see TrafficShaper. Each command code belongs to one of
+    // TrafficShaper::kNumClasses traffic classes, 0 unless set, and lower classes are released first.
+    // Frames of a class which is out of tokens wait in order in a queue of their own while the other
+    // classes keep sending, a timer on the io context releases them once the tokens refill. Heartbeats
+    // and capabilities are never held back. Set the classes before Start(), the rates may change any time
+    // and the held back commands are looked at again, all of them go once the last rate is removed
+    void SetTrafficClass(uint16_t cmd, uint8_t traffic_class);
+    void SetLinkRate(double bytes_per_sec, double burst_bytes);
+    void SetClassRate(uint8_t traffic_class, double bytes_per_sec, double burst_bytes);
+    struct ShapingStats {
+        uint64_t frames;      // sent in the class
+        uint64_t delayed;     // of which waited for tokens
+        double mean_delay_ms; // time the delayed frames were held back, to size the budgets
+        double max_delay_ms;
+        size_t queued;        // waiting for tokens now
+    };
+    // Also takes TrafficShaper::kControlClass, the heartbeats and capabilities which are never held
+    ShapingStats GetShapingStats(uint8_t traffic_class);
     void WriteRecvBuffer(const Command& cmd_struct);
     bool DataInSendBuffer();
     bool DataInRecvBuffer();
 
     Command ReadRecvBuffer();
     std::vector<Command> ReadRecvBuffer(size_t num_cmds);
+    // Timed reads, give up after the timeout instead of blocking indefinitely.
+    // The batch read waits for at least one command then drains up to num_cmds under a single lock
+    bool ReadRecvBuffer(Command &cmd, std::chrono::milliseconds timeout);
+    std::vector<Command> ReadRecvBuffer(size_t num_cmds, std::chrono::milliseconds timeout);
+    std::vector<Command> TryReadRecvBuffer(size_t num_cmds) {
+        return ReadRecvBuffer(num_cmds, std::chrono::milliseconds(0));
+    }
 
-    bool getSocketIsOpen() const { return socket_.is_open(); }
+    // Pollable eventfd which is readable while the receive buffer holds commands, for use
+    // with select/poll/epoll or an asyncio loop. Created on first call, owned by the connection
+    int GetRecvNotifyFd();
+    // Block until any of the connections has a command waiting or the timeout expires,
+    // returns the indices of the ready connections. See ConnectionPoller to reuse the epoll set
+    static std::vector<size_t> WaitAny(const std::vector<std::shared_ptr<TCPConnection>> &connections,
+                                       std::chrono::milliseconds timeout);
+
+    // Register a handler for a command code. Inline handlers run on the io thread as soon as the
+    // frame is decoded, so the command skips the receive buffer, its mutex and the consumer wakeup
+    // entirely. Other handlers are called by DispatchRecvBuffer() on the consumer thread.
+    // Codes without a handler go to the receive buffer as before. Register before Start(),
+    // the table is read by the io thread without locking
+    void RegisterHandler(uint16_t cmd, CommandHandler handler, bool run_inline = false);
+    // Drain the receive buffer, calling the registered handler for each command.
+    // Commands without a handler are returned in arrival order
+    std::vector<Command> DispatchRecvBuffer();
+
+    // Latest value cache. Registered codes are never queued, each received frame overwrites the code's
+    // slot in place, so bursts of status frames cost a copy each and no memory or consumer work.
+    // Frames with more than max_args arguments don't fit the slot and are queued as usual.
+    // Register before Start(), the table is read by the io thread without locking
+    void EnableLatestValue(uint16_t cmd, size_t max_args);
+    // Copy the newest frame of a code into latest, lock free and callable from any thread at any time.
+    // Returns the number of frames received for the code so far, so a caller can tell whether it is
+    // new since the last read, or 0 if none has arrived (latest is then left untouched)
+    uint64_t ReadLatest(uint16_t cmd, Command &latest) const;
+
+    // Give a consumer its own queue of the received codes in [first, last], optionally narrowed by a
+    // predicate run on the io thread, see Subscription. A command is handed by reference to every open
+    // subscription it matches instead of the receive buffer, commands matching none are queued there
+    // as usual. Inline handlers and latest value codes take precedence. Subscribe before Start(),
+    // the list is read by the io thread without locking
+    std::shared_ptr<Subscription> Subscribe(uint16_t first, uint16_t last, size_t capacity = kSubscriptionCapacity);
+    std::shared_ptr<Subscription> Subscribe(Subscription::Predicate predicate, size_t capacity = kSubscriptionCapacity);
+    constexpr static size_t kSubscriptionCapacity = 1024;
+
+    bool getSocketIsOpen() const {
+        return socket_.is_open() || shm_connected_.load() || sim_connected_.load() || (udp_socket_ && udp_socket_->is_open());
+    }
+
+    // UDP monitor links send one frame per datagram behind a sequence number. Nothing is retransmitted,
+    // gaps in the sequence are counted as lost and late datagrams are dropped so a lost status snapshot
+    // never holds up the next one. The server replies to the last client it heard from
+    struct DatagramStats {
+        uint64_t received;
+        uint64_t lost;         // sequence numbers skipped
+        uint64_t out_of_order; // arrived after a later datagram, dropped
+        uint64_t corrupt;      // failed to decode
+        std::chrono::milliseconds age; // since the last good datagram, max() if none yet
+    };
+    DatagramStats GetDatagramStats() const;
+    // Client stream links can fail over between endpoints, tried in the order added after the constructor's.
+    // A standby socket is kept connected to the next endpoint, idle except for answering heartbeats, and
+    // when the link fails (heartbeat timeout, EOF or a read error) it takes over straight away with the
+    // send queue intact. What the new peer sent the standby is decoded then, past 1 MiB only its capabilities.
+    // Without a standby ready the client reconnects as usual, moving on to the next endpoint each time a
+    // connect fails. Add before Start(), throws std::invalid_argument on servers and shm/udp links
+    void AddFailoverEndpoint(const std::string& address, uint16_t port);
+    size_t GetActiveEndpoint() const { return active_endpoint_.load(); } // index in the order added, 0 first
+    uint64_t GetFailoverCount() const { return failovers_.load(); }
     void setStopCmdRead() {
         stop_server_.store(true);
         stop_cmd_read_.store(true);
         cmd_available_.notify_all();
+        send_cmd_available_.notify_all(); // let the send thread see the stop
+        AbortSendBuffer(); // commands still queued or held back by the shaper hold references to us
+        AbortWaiters();
     }
 
+    // Asio completion token versions of the asynchronous interface. The completion handler is invoked
+    // on its associated executor, eg. AsyncReceive(asio::use_awaitable) resumes the awaiting coroutine
+    template <typename CompletionToken>
+    auto AsyncSend(Command cmd, CompletionToken &&token) {
+        return asio::async_initiate<CompletionToken, void(asio::error_code)>(
+            [this](auto handler, Command cmd) {
+                WriteSendBuffer(std::move(cmd), SendCallback(MakeCallback(std::move(handler))));
+            }, token, std::move(cmd));
+    }
+    template <typename CompletionToken>
+    auto AsyncReceive(CompletionToken &&token) {
+        return asio::async_initiate<CompletionToken, void(asio::error_code, Command)>(
+            [this](auto handler) {
+                ReadRecvBuffer(ReceiveCallback(MakeCallback(std::move(handler))));
+            }, token);
+    }
+    template <typename CompletionToken>
+    auto AsyncRequest(Command cmd, std::chrono::milliseconds timeout, CompletionToken &&token) {
+        return asio::async_initiate<CompletionToken, void(asio::error_code, Command)>(
+            [this](auto handler, Command cmd, std::chrono::milliseconds timeout) {
+                SendRequest(std::move(cmd), ReceiveCallback(MakeCallback(std::move(handler))), timeout);
+            }, token, std::move(cmd), timeout);
+    }
+    template <typename CompletionToken>
+    auto AsyncRequest(Command cmd, CompletionToken &&token) {
+        return AsyncRequest(std::move(cmd), kNoTimeout, std::forward<CompletionToken>(token));
+    }
+
+#if defined(ASIO_HAS_CO_AWAIT)
+    // C++20 coroutine interface, errors are thrown as asio::system_error
+    //   Command cmd = co_await conn->Receive();
+    //   co_await conn->Send(Command(0x10, 2));      // resumes once written to the socket
+    //   Command ack = co_await conn->Request(cmd);  // resumes once the peer acks the command
+    asio::awaitable<Command> Receive() { co_return co_await AsyncReceive(asio::use_awaitable); }
+    asio::awaitable<void> Send(Command cmd) { co_await AsyncSend(std::move(cmd), asio::use_awaitable); }
+    asio::awaitable<Command> Request(Command cmd, std::chrono::milliseconds timeout = kNoTimeout) {
+        co_return co_await AsyncRequest(std::move(cmd), timeout, asio::use_awaitable);
+    }
+#endif
+
     // Functions to help manage the async IO context from python
     std::thread python_io_context_thread_;
     std::unique_ptr<asio::executor_work_guard<asio::io_context::executor_type>> python_work_guard_;
@@ -46,6 +269,7 @@ public:
         Start();
         python_work_guard_ = std::make_unique<asio::executor_work_guard<asio::io_context::executor_type>>(ctx.get_executor());
         python_io_context_thread_ = std::thread([&ctx]() {
+            ThreadControl::Scope scope("io");
             try {
                 ctx.run();
             } catch (const std::exception &e) {
@@ -67,10 +291,13 @@ private:
 
     TCPProtocol tcp_protocol_;
 
-    std::optional<tcp::acceptor> acceptor_;
-    std::optional<tcp::socket> accept_socket_;
-    tcp::endpoint endpoint_;
-    tcp::socket socket_;
+    // Generic stream sockets so the same link runs over TCP or a unix domain socket
+    using stream_protocol = asio::generic::stream_protocol;
+    static stream_protocol::endpoint MakeEndpoint(const std::string& address, uint16_t port);
+    std::optional<asio::basic_socket_acceptor<stream_protocol>> acceptor_;
+    std::optional<stream_protocol::socket> accept_socket_;
+    stream_protocol::endpoint endpoint_;
+    stream_protocol::socket socket_;
     std::array<uint8_t, TCPProtocol::RECVBUFFSIZE> buffer_{};
     uint16_t port_;
     bool client_connected_;
@@ -101,11 +328,21 @@ private:
     std::atomic_bool packet_read_{false};
     std::atomic_bool reset_read_timer_{false};
     std::chrono::time_point<std::chrono::steady_clock> start_;
+    // Link supervision, on the link's virtual clock for sim: links. The server sends a heartbeat every
+    // period, an end which reads nothing for the timeout (mid frame, or at all with heartbeats) drops
+    // the link and the client waits the delay before reconnecting
+    constexpr static std::chrono::milliseconds kHeartbeatPeriod{1000};
+    constexpr static std::chrono::milliseconds kReadTimeout{5000};
+    constexpr static std::chrono::milliseconds kReconnectDelay{1000};
+    bool ReadTimeoutArmed() const { return (is_server_ || client_connected_) && (packet_read_ || use_heartbeat_); }
 
     void StartClient();
+    void Reconnect();
+    void Connect();
     void ClearSocketBuffer();
     void StartServer();
     void ReadHandler(const asio::error_code& ec, std::size_t bytes_transferred);
+    void DecodeReceived(std::size_t bytes_transferred);
     void SendHandler(const asio::error_code& ec, const std::size_t &bytes_sent);
     void ReadData();
     void EchoData();
@@ -118,6 +355,240 @@ private:
     std::condition_variable send_cmd_available_;
     Command recv_command_;
 
+    // Signal the notify fd when the receive buffer becomes non-empty and
+    // clear it once drained, must be called holding recv_mutex_
+    int recv_notify_fd_{-1};
+    void SignalRecvNotify();
+    void ClearRecvNotify();
+
+    // Dispatch table, a flat array indexed by the 16b command code holding an index into
+    // handlers_ (0 means no handler). Allocated on the first registration
+    struct HandlerEntry {
+        CommandHandler handler;
+        bool run_inline;
+    };
+    std::vector<uint32_t> handler_index_;
+    std::vector<HandlerEntry> handlers_;
+    const HandlerEntry* FindHandler(uint16_t cmd) const {
+        if (handler_index_.empty() || handler_index_[cmd] == 0) return nullptr;
+        return &handlers_[handler_index_[cmd] - 1];
+    }
+    // Seqlock protected latest value slots, indexed like the handlers. The sequence is odd while the io
+    // thread writes the slot, readers copy the words and retry if the sequence moved under them
+    struct LatestSlot {
+        explicit LatestSlot(const size_t max_args) : capacity(max_args), words(new std::atomic<uint32_t>[max_args]()) {}
+        std::atomic<uint64_t> sequence{0};
+        std::atomic<uint32_t> arg_count{0};
+        size_t capacity;
+        std::unique_ptr<std::atomic<uint32_t>[]> words;
+    };
+    std::vector<uint32_t> latest_index_;
+    std::vector<std::unique_ptr<LatestSlot>> latest_slots_;
+    LatestSlot* FindLatest(uint16_t cmd) const {
+        if (latest_index_.empty() || latest_index_[cmd] == 0) return nullptr;
+        return latest_slots_[latest_index_[cmd] - 1].get();
+    }
+    std::vector<std::shared_ptr<Subscription>> subscriptions_;
+    // Hand a received command to its matching subscriptions, false if there are none
+    bool Publish(Command &cmd);
+    // Run the inline handler for a received command or queue it for the consumers
+    void DeliverCommand(Command &cmd);
+
+    // Pending asynchronous receives and requests waiting on an ack. Requests are keyed by their
+    // id, which is also the correlation id, so iterating the map visits them in send order
+    struct PendingRequest {
+        uint16_t command;
+        bool correlated;
+        ReceiveCallback on_ack;
+        std::shared_ptr<asio::steady_timer> deadline;
+    };
+    std::deque<ReceiveCallback> recv_waiters_;
+    std::mutex request_mutex_;
+    std::map<uint32_t, PendingRequest> pending_requests_;
+    std::atomic<size_t> num_pending_requests_{0};
+    uint32_t next_request_id_{0};
+    bool CompleteRequest(Command &cmd, bool correlated, uint32_t correlation_id);
+    void FailRequest(uint32_t request_id, const asio::error_code &ec);
+    void AbortWaiters();
+    void AbortSendBuffer();
+
+    // Shared memory transport, used instead of the socket when shm_name_ is set. The receive
+    // thread attaches to the segment, then runs the decoder on frames read from the ring
+    std::string shm_name_;
+    std::unique_ptr<ShmTransport> shm_;
+    std::atomic_bool shm_connected_{false};
+    void ShmReadData();
+
+    // Simulated link, used instead of the socket when sim_ is set. The receive thread reads the frames
+    // of the link's session in sim_session_ and starts a new session whenever the link comes back up.
+    // The link's threads take part in its clock, sim_send_blocked_ (guarded by send_mutex_) is set while
+    // the send thread waits for commands and cleared by whoever queues the next one
+    std::shared_ptr<SimLink> sim_;
+    std::atomic<uint64_t> sim_session_{0};
+    std::atomic_bool sim_connected_{false};
+    bool sim_send_blocked_{false};
+    void SimReadData();
+    void WakeSimSender();
+
+    // Datagram transport for UDP monitor links, used instead of the stream socket when udp_socket_ is set
+    std::optional<asio::ip::udp::socket> udp_socket_;
+    asio::ip::udp::endpoint udp_endpoint_;  // bound by the server, connected by the client
+    asio::ip::udp::endpoint udp_sender_;    // source of the datagram being received
+    asio::ip::udp::endpoint udp_peer_;      // where the server sends, guarded by udp_mutex_
+    bool udp_peer_known_{false};
+    std::mutex udp_mutex_;
+    uint32_t recv_datagram_seq_{0};         // receive sequence state, only used by the io thread
+    uint32_t expected_datagram_seq_{0};
+    bool datagram_seq_synced_{false};
+    uint32_t send_datagram_seq_{0};         // only used by the send thread
+    std::vector<uint8_t> datagram_buffer_;
+    std::atomic<uint64_t> datagrams_received_{0};
+    std::atomic<uint64_t> datagrams_lost_{0};
+    std::atomic<uint64_t> datagrams_out_of_order_{0};
+    std::atomic<uint64_t> datagrams_corrupt_{0};
+    std::atomic<int64_t> last_datagram_ns_{0};
+    void StartDatagram();
+    void ReadDatagram();
+    void HandleDatagram(std::size_t bytes_transferred);
+    asio::error_code SendDatagram(const std::vector<uint8_t> &frame);
+
+    // Zero copy sends, the state is only touched by the send thread. Each zero copy send() takes
+    // the next sequence number and its buffer is held until the kernel completes that number
+    size_t zerocopy_min_bytes_{0};
+    bool zerocopy_enabled_{false};
+    uint32_t zerocopy_next_seq_{0};
+    std::deque<std::pair<uint32_t, std::shared_ptr<const std::vector<uint8_t>>>> zerocopy_pending_;
+    bool EnableZeroCopy();
+    void SendZeroCopy(const std::shared_ptr<const std::vector<uint8_t>> &buffer, asio::error_code &ec);
+    void ReapZeroCopy();
+    // Normal sends are async_writes completing on the io thread, the send thread waits for
+    // the previous one before starting the next write so frames go out whole and in order
+    std::mutex write_mutex_;
+    std::condition_variable write_done_;
+    size_t writes_in_flight_{0};
+    void WaitForWrites();
+
+    // Protocol extensions we offer and the subset the peer has advertised back
+    uint32_t local_capabilities_{0};
+    std::atomic<uint32_t> peer_capabilities_{0};
+    // Called on connect, clears the peer's capabilities and has the client advertise its own. The server
+    // queues its answer once it has the client's
+    void SendCapabilities();
+    void QueueCapabilities();
+    std::bitset<UINT16_MAX + 1> compressed_codes_;
+    DeltaCodec encoder_;  // used by the send thread
+    DeltaCodec decoder_;  // used by the thread running the decoder
+    // Fragmentation
+    uint32_t next_message_id_{0};  // used by the send thread
+    Reassembler reassembler_;      // used by the thread running the decoder
+    void SendFragments(const Command &cmd, SendCallback on_sent);
+    bool Reassemble(Command &cmd);
+    // Link control frames go out alone, the receiver only handles heartbeats and their acks in DecodeReceived
+    static bool Batchable(const Command &cmd) {
+        return cmd.arguments.size() <= TCPProtocol::kMaxBatchedArgs && cmd.command != TCPProtocol::kCapabilities &&
+               cmd.command != TCPProtocol::kHeartBeat;
+    }
+    // Traffic shaping, all guarded by send_mutex_. Commands the shaper holds back move from the send
+    // buffer to the queue of their class, shaping_release_ is raised by the timer when one can go
+    TrafficShaper shaper_;
+    std::vector<uint8_t> traffic_classes_; // by command code, empty until a class is set
+    struct ShapedEntry {
+        SendEntry entry;
+        TrafficShaper::Clock::time_point queued;
+    };
+    std::array<std::deque<ShapedEntry>, TrafficShaper::kNumClasses> shaped_queues_;
+    bool shaping_release_{false};
+    TrafficShaper::Clock::time_point shaping_deadline_{}; // of the armed timer, zero if none
+    asio::steady_timer shaping_timer_;
+    size_t TrafficClass(uint16_t cmd) const;
+    bool NextShapedEntry(SendEntry &entry, size_t &traffic_class, TrafficShaper::Clock::time_point now);
+    void ArmShapingTimer(TrafficShaper::Clock::time_point now);
+    bool HeldBack() const;
+    void ReleaseShaped(std::unique_lock<std::mutex> &lock);
+    // Expiry, the ages are read only once started and the counts are guarded by send_mutex_. The send
+    // thread checks the expiry of each command it takes off a queue, so nothing is ever scanned
+    std::vector<std::chrono::milliseconds> max_queue_ages_; // by command code, empty until an age is set
+    std::map<uint16_t, uint64_t> expired_counts_;
+    std::vector<SendCallback> expired_callbacks_; // run by the send thread once it drops the lock
+    std::chrono::steady_clock::time_point ExpiryOf(uint16_t cmd) const;
+    bool Expired(SendEntry &entry, std::chrono::steady_clock::time_point now);
+    void RunExpiredCallbacks();
+    void QueueSend(SendEntry &&entry);
+    // Conflation, guarded by send_mutex_. Queue elements don't move while they are in a deque, so the
+    // slot points at the waiting command of each conflated code until it leaves the queues
+    std::bitset<UINT16_MAX + 1> conflated_codes_;
+    std::unordered_map<uint16_t, SendEntry*> conflation_slots_;
+    std::map<uint16_t, uint64_t> conflated_counts_;
+    SendCallback Conflate(SendEntry &entry);
+    bool ReleaseConflation(const SendEntry &entry);
+    // Failover, endpoints_[0] is the constructor's endpoint. The standby state is used by io thread
+    // handlers and guarded by standby_mutex_, stale handlers see a different standby_generation_
+    std::vector<stream_protocol::endpoint> endpoints_;
+    std::atomic<size_t> active_endpoint_{0};
+    size_t standby_endpoint_{0};
+    std::optional<stream_protocol::socket> standby_socket_;
+    bool standby_ready_{false};
+    uint64_t standby_generation_{0};
+    std::vector<uint8_t> standby_bytes_;  // received on the standby, heartbeats removed
+    size_t standby_scanned_{0};           // standby_bytes_ before this are whole frames
+    std::mutex standby_mutex_;
+    asio::steady_timer standby_timer_;
+    // Only the peer's capabilities are kept past this, the standby isn't read by anyone until a failover
+    constexpr static size_t kMaxStandbyBytes = 1 << 20;
+    std::atomic<uint64_t> failovers_{0};
+    size_t prefilled_bytes_{0};           // bytes of the next read already in buffer_
+    void ConnectStandby(std::chrono::milliseconds delay);
+    void WaitStandby();
+    void ReadStandby();
+    void DropStandby();
+    bool Failover();
+    void FeedReceived(const uint8_t *data, size_t size);
+    // The io thread never waits on the send thread, the delays and stops before a reconnect run on timers
+    asio::steady_timer reconnect_timer_;
+    asio::steady_timer send_stop_timer_;
+    std::atomic_bool send_thread_exited_{true};
+    void StopSendThread(std::function<void()> next);
+    void StartSendThread();
+    // Write one serialized frame to whichever transport the link uses
+    void SendFrame(const std::shared_ptr<const std::vector<uint8_t>> &buffer, SendCallback on_sent);
+    // Monitor clients only wait on a large read to notice the link dropping, unless they use protocol
+    // extensions and so have to decode the server's capabilities frame
+    size_t FirstReadSize() const {
+        return monitor_link_ && local_capabilities_ == 0 ? 0xFFFF : sizeof(TCPProtocol::Header);
+    }
+    // Handle link control commands and envelopes, then deliver the command and ack it
+    void ProcessCommand(Command &cmd);
+    void SendAck(uint16_t cmd, size_t received_bytes, std::optional<uint32_t> correlation_id);
+
+    // Wrap a completion handler in a copyable callback which posts it to its associated executor
+    template <typename Handler>
+    auto MakeCallback(Handler &&handler) {
+        auto shared_handler = std::make_shared<std::decay_t<Handler>>(std::forward<Handler>(handler));
+        auto executor = asio::get_associated_executor(*shared_handler, socket_.get_executor());
+        return [shared_handler, executor](const asio::error_code &ec, auto... result) {
+            asio::post(executor, [shared_handler, ec, result...]() mutable {
+                std::move(*shared_handler)(ec, std::move(result)...);
+            });
+        };
+    }
+
+};
+
+// Multiplexes the receive notify fds of several connections with epoll, so a consumer
+// thread can sleep on all of its links and wake as soon as any of them receives a command
+class ConnectionPoller {
+public:
+    explicit ConnectionPoller(const std::vector<std::shared_ptr<TCPConnection>> &connections);
+    ~ConnectionPoller();
+    ConnectionPoller(const ConnectionPoller&) = delete;
+    ConnectionPoller& operator=(const ConnectionPoller&) = delete;
+
+    // Returns the indices of the connections with commands waiting, empty on timeout
+    std::vector<size_t> Wait(std::chrono::milliseconds timeout);
+
+private:
+    int epoll_fd_;
+    std::vector<std::shared_ptr<TCPConnection>> connections_;
 };
 
 #endif  // TCP_SERVER_H_
@@ -0,0 +1,51 @@
+//
+// Parallel command dispatcher for the receive stream.
+//
+
+#include "tcp_dispatcher.h"
+#include <algorithm>
+
+CommandDispatcher::CommandDispatcher(const size_t num_threads, KeyFunction key_function)
+    : pool_(num_threads),
+      key_function_(std::move(key_function)) {
+    const size_t num_strands = std::max<size_t>(num_threads, 1) * kStrandsPerThread;
+    strands_.reserve(num_strands);
+    for (size_t i = 0; i < num_strands; i++) strands_.push_back(asio::make_strand(pool_));
+}
+
+CommandDispatcher::~CommandDispatcher() {
+    Join();
+}
+
+void CommandDispatcher::RegisterHandler(const uint16_t cmd, CommandHandler handler) {
+    handlers_[cmd] = std::move(handler);
+}
+
+void CommandDispatcher::Attach(TCPConnection &connection) {
+    for (const auto &handler : handlers_) {
+        connection.RegisterHandler(handler.first, [this](Command &cmd) { Post(std::move(cmd)); }, true);
+    }
+}
+
+bool CommandDispatcher::Post(Command cmd) {
+    const auto handler = handlers_.find(cmd.command);
+    if (handler == handlers_.end()) return false;
+    const uint64_t key = key_function_ ? key_function_(cmd) : cmd.command;
+    const CommandHandler *p_handler = &handler->second;
+    asio::post(GetStrand(key), [p_handler, cmd = std::move(cmd)]() mutable {
+        try {
+            (*p_handler)(cmd);
+        } catch (const std::exception &e) {
+            std::cerr << "Handler for command " << cmd.command << " threw: " << e.what() << std::endl;
+        }
+    });
+    return true;
+}
+
+void CommandDispatcher::Join() {
+    pool_.join();
+}
+
+CommandDispatcher::Strand& CommandDispatcher::GetStrand(const uint64_t key) {
+    return strands_[std::hash<uint64_t>{}(key) % strands_.size()];
+}
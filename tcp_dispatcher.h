@@ -0,0 +1,51 @@
+//
+// Parallel command dispatcher for the receive stream.
+//
+
+#ifndef TCP_DISPATCHER_H
+#define TCP_DISPATCHER_H
+
+#include <asio.hpp>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include "tcp_connection.h"
+
+// Runs command handlers on a pool of worker threads. Each key (the command code unless a key
+// function is given) is hashed onto one of a fixed set of strands, so commands with the same key
+// are handled one at a time in arrival order while commands with different keys run in parallel
+// on any free worker, unless they happen to share a strand.
+class CommandDispatcher {
+public:
+    using KeyFunction = std::function<uint64_t(const Command&)>;
+
+    explicit CommandDispatcher(size_t num_threads, KeyFunction key_function = nullptr);
+    ~CommandDispatcher();
+
+    // Register handlers before Attach() or Post(), the table is read without locking
+    void RegisterHandler(uint16_t cmd, CommandHandler handler);
+
+    // Route every code with a handler from the connection's io thread straight into the pool,
+    // the commands never touch the connection's receive buffer. The dispatcher must outlive the connection
+    void Attach(TCPConnection &connection);
+
+    // Queue a command on its key's strand, returns false if no handler is registered for it
+    bool Post(Command cmd);
+
+    // Wait for all queued work to finish, no more commands may be posted afterwards
+    void Join();
+
+private:
+    using Strand = asio::strand<asio::thread_pool::executor_type>;
+
+    asio::thread_pool pool_;
+    KeyFunction key_function_;
+    std::unordered_map<uint16_t, CommandHandler> handlers_;
+
+    // A few strands a thread so unrelated keys rarely wait on each other, however many keys there are
+    static constexpr size_t kStrandsPerThread = 8;
+    std::vector<Strand> strands_;
+    Strand& GetStrand(uint64_t key);
+};
+
+#endif  // TCP_DISPATCHER_H
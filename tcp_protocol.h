@@ -12,6 +12,7 @@
 #include <array>
 #include <deque>
 #include <utility>
+#include <algorithm>
 #include <netinet/in.h>
 
 // class Command;
@@ -97,6 +98,102 @@ public:
     static constexpr uint16_t kHeartBeat = 0xFFFF;
     static constexpr uint32_t kCorruptData = 0x7000;
 
+    // Link control commands, these are consumed by the connection and never reach the application.
+    // A peer advertises the optional protocol extensions it supports with a capabilities command
+    // on connect, extensions are only used once both sides have advertised them
+    static constexpr uint16_t kCapabilities = 0xFFFE;  // args: [kCapabilityMagic, capability bits]
+    static constexpr uint16_t kCorrelated = 0xFFFD;    // args: [correlation id, command, command args...]
+    static constexpr uint16_t kCorrelatedReply = 0xFFFC; // ack of a kCorrelated command, same layout
+    static constexpr uint16_t kCompressed = 0xFFFB;    // args: see DeltaCodec
+    static constexpr uint16_t kFragment = 0xFFFA;      // args: [message id, fragment index, command, total arg count, args slice...]
+    static constexpr uint16_t kBatch = 0xFFF9;         // args: [command | arg count << 16, args...] repeated
+    static constexpr uint32_t kCapabilityMagic = 0x43415053; // "CAPS"
+
+    // Capability bits
+    static constexpr uint32_t kCapCorrelation = 1u << 0; // request/ack correlation ids
+    static constexpr uint32_t kCapCompression = 1u << 1; // delta compressed frames
+    static constexpr uint32_t kCapFragmentation = 1u << 2; // commands with more args than fit in one frame
+    static constexpr uint32_t kCapBatching = 1u << 3;      // several small commands in one kBatch frame
+
+    // A frame carries at most 2^16-1 args. Larger commands are split over kFragment frames, sent back to
+    // back, and reassembled by the receiver up to kMaxMessageArgs (256 MB)
+    static constexpr size_t kMaxFrameArgs = UINT16_MAX;
+    static constexpr size_t kFragmentHeaderWords = 4;
+    static constexpr size_t kMaxFragmentArgs = kMaxFrameArgs - kFragmentHeaderWords;
+    static constexpr size_t kMaxMessageArgs = 1u << 26;
+    // Commands queued together share a kBatch frame if they have at most kMaxBatchedArgs args each,
+    // which keeps a full batch well inside one frame
+    static constexpr size_t kMaxBatchedArgs = 256;
+    static constexpr size_t kMaxBatchCommands = 64;
+
+    // Size of the frame carrying cmd on its own
+    static size_t FrameBytes(const Command &cmd) {
+        return header_size_ + cmd.arguments.size() * sizeof(uint32_t) + footer_size_;
+    }
+
+    // Wrap a command in a kCorrelated (or kCorrelatedReply) envelope carrying the correlation id
+    static Command Correlate(const uint32_t correlation_id, Command &&cmd, const bool reply = false) {
+        Command envelope(reply ? kCorrelatedReply : kCorrelated, cmd.arguments.size() + 2);
+        envelope.arguments[0] = correlation_id;
+        envelope.arguments[1] = cmd.command;
+        std::copy(cmd.arguments.begin(), cmd.arguments.end(), envelope.arguments.begin() + 2);
+        return envelope;
+    }
+
+    // Unwrap a correlation envelope in place, returns false if cmd is not a valid envelope
+    static bool Uncorrelate(Command &cmd, uint32_t &correlation_id, bool &reply) {
+        if ((cmd.command != kCorrelated && cmd.command != kCorrelatedReply) || cmd.arguments.size() < 2) return false;
+        reply = cmd.command == kCorrelatedReply;
+        correlation_id = cmd.arguments[0];
+        cmd.command = static_cast<uint16_t>(cmd.arguments[1]);
+        cmd.arguments.erase(cmd.arguments.begin(), cmd.arguments.begin() + 2);
+        return true;
+    }
+
+    // The index'th kFragment frame of cmd, carrying the next kMaxFragmentArgs of its args
+    static Command Fragment(const Command &cmd, const uint32_t message_id, const uint32_t index) {
+        const size_t offset = std::min(static_cast<size_t>(index) * kMaxFragmentArgs, cmd.arguments.size());
+        const size_t count = std::min(cmd.arguments.size() - offset, kMaxFragmentArgs);
+        Command fragment(kFragment, kFragmentHeaderWords + count);
+        fragment.arguments[0] = message_id;
+        fragment.arguments[1] = index;
+        fragment.arguments[2] = cmd.command;
+        fragment.arguments[3] = static_cast<uint32_t>(cmd.arguments.size());
+        std::copy(cmd.arguments.begin() + offset, cmd.arguments.begin() + offset + count,
+                  fragment.arguments.begin() + kFragmentHeaderWords);
+        return fragment;
+    }
+
+    // Pack commands into a single kBatch command, each one prefixed by a word holding its code and arg count
+    static Command Batch(const std::vector<Command> &cmds) {
+        size_t num_words = 0;
+        for (const auto &cmd : cmds) num_words += 1 + cmd.arguments.size();
+        Command batch(kBatch, 0);
+        batch.arguments.reserve(num_words);
+        for (const auto &cmd : cmds) {
+            batch.arguments.push_back(cmd.command | static_cast<uint32_t>(cmd.arguments.size()) << 16);
+            batch.arguments.insert(batch.arguments.end(), cmd.arguments.begin(), cmd.arguments.end());
+        }
+        return batch;
+    }
+
+    // Unpack a kBatch command into cmds, returns false if it is malformed or nests another batch
+    static bool Unbatch(const Command &batch, std::vector<Command> &cmds) {
+        if (batch.command != kBatch) return false;
+        const std::vector<uint32_t> &args = batch.arguments;
+        size_t pos = 0;
+        while (pos < args.size()) {
+            const auto cmd_code = static_cast<uint16_t>(args[pos] & 0xFFFF);
+            const size_t num_args = args[pos] >> 16;
+            pos++;
+            if (cmd_code == kBatch || num_args > args.size() - pos) return false;
+            cmds.emplace_back(cmd_code, 0);
+            cmds.back().arguments.assign(args.begin() + pos, args.begin() + pos + num_args);
+            pos += num_args;
+        }
+        return true;
+    }
+
     // static uint16_t CalcCRC(std::vector<uint8_t> &pbuffer, size_t num_bytes, uint16_t crc = 0);
     // static uint16_t CalcCRC(const uint8_t *pbuffer, size_t num_bytes, uint16_t crc = 0);
 
@@ -264,4 +361,64 @@ private:
 
 };
 
+// Puts the kFragment frames of a message back together. The fragments of a message are sent back to
+// back, so only one message is assembled at a time, into a buffer reserved for its full size by the
+// first fragment
+class Reassembler {
+public:
+    enum Result {
+        kPending,       // the fragment was added, more are to come
+        kComplete,      // cmd has been replaced by the whole message
+        kMalformed,     // too short to be a fragment
+        kTooLarge,      // the message has more than kMaxMessageArgs args, it is dropped
+        kOutOfSequence, // a fragment went missing, the message is dropped
+        kDiscarded,     // the rest of a message which was dropped
+        kInterrupted    // a new message started before the last one completed, the last one is dropped
+    };
+
+    Result Add(Command &cmd) {
+        const std::vector<uint32_t> &args = cmd.arguments;
+        if (args.size() < TCPProtocol::kFragmentHeaderWords) return kMalformed;
+        const uint32_t message_id = args[0];
+        const uint32_t index = args[1];
+        const auto command = static_cast<uint16_t>(args[2]);
+        const uint32_t total = args[3];
+        const size_t count = args.size() - TCPProtocol::kFragmentHeaderWords;
+
+        bool interrupted = false;
+        if (index == 0) {
+            interrupted = active_;
+            active_ = total <= TCPProtocol::kMaxMessageArgs;
+            if (!active_) return kTooLarge;
+            message_id_ = message_id;
+            next_index_ = 0;
+            total_ = total;
+            message_ = Command(command, 0);
+            message_.arguments.reserve(total);
+        }
+        if (!active_ || message_id != message_id_ || index != next_index_ || command != message_.command ||
+            total != total_ || count > total - message_.arguments.size()) {
+            const bool dropped = active_;
+            active_ = false;
+            return dropped ? kOutOfSequence : kDiscarded;
+        }
+        message_.arguments.insert(message_.arguments.end(), args.begin() + TCPProtocol::kFragmentHeaderWords, args.end());
+        next_index_++;
+        if (message_.arguments.size() < total) return interrupted ? kInterrupted : kPending;
+
+        active_ = false;
+        cmd = std::move(message_);
+        return kComplete;
+    }
+    // Discard the message in progress, eg. when the link reconnects
+    void Reset() { active_ = false; }
+
+private:
+    bool active_{false};
+    uint32_t message_id_{0};
+    uint32_t next_index_{0};
+    uint32_t total_{0};
+    Command message_{0, 0};
+};
+
 #endif  // TCP_PROTOCOL_H
@@ -0,0 +1,73 @@
+//
+// Token bucket traffic shaping for the send pipeline.
+//
+
+#include "tcp_shaper.h"
+#include <algorithm>
+#include <stdexcept>
+
+void TrafficShaper::Bucket::Refill(const Clock::time_point now) {
+    if (!Limited() || now <= updated) return;
+    tokens = std::min(burst, tokens + rate * std::chrono::duration<double>(now - updated).count());
+    updated = now;
+}
+
+TrafficShaper::Clock::time_point TrafficShaper::Bucket::ReadyAt(const Clock::time_point now) const {
+    if (!Limited() || tokens > 0) return now;
+    // One microsecond past the time the debt is paid off, so the bucket is strictly positive
+    const auto wait = std::chrono::duration<double>(-tokens / rate) + std::chrono::microseconds(1);
+    return updated + std::chrono::duration_cast<Clock::duration>(wait);
+}
+
+void TrafficShaper::SetLinkRate(const double bytes_per_sec, const double burst_bytes) {
+    link_ = {bytes_per_sec, burst_bytes, burst_bytes, Clock::now()};
+    UpdateEnabled();
+}
+
+void TrafficShaper::SetClassRate(const size_t traffic_class, const double bytes_per_sec, const double burst_bytes) {
+    if (traffic_class >= kNumClasses) throw std::out_of_range("Traffic class must be below " + std::to_string(kNumClasses));
+    classes_[traffic_class] = {bytes_per_sec, burst_bytes, burst_bytes, Clock::now()};
+    UpdateEnabled();
+}
+
+void TrafficShaper::UpdateEnabled() {
+    enabled_ = link_.Limited() ||
+        std::any_of(classes_.begin(), classes_.end(), [](const Bucket &bucket) { return bucket.Limited(); });
+}
+
+bool TrafficShaper::Ready(const size_t traffic_class, const Clock::time_point now) {
+    if (traffic_class == kControlClass) return true;
+    link_.Refill(now);
+    Bucket &bucket = classes_[traffic_class];
+    bucket.Refill(now);
+    return (!link_.Limited() || link_.tokens > 0) && (!bucket.Limited() || bucket.tokens > 0);
+}
+
+TrafficShaper::Clock::time_point TrafficShaper::ReadyAt(const size_t traffic_class, const Clock::time_point now) {
+    if (traffic_class == kControlClass) return now;
+    return std::max(link_.ReadyAt(now), classes_[traffic_class].ReadyAt(now));
+}
+
+void TrafficShaper::Consume(const size_t traffic_class, const size_t bytes) {
+    if (link_.Limited()) link_.tokens -= static_cast<double>(bytes);
+    if (traffic_class < kNumClasses && classes_[traffic_class].Limited()) {
+        classes_[traffic_class].tokens -= static_cast<double>(bytes);
+    }
+}
+
+void TrafficShaper::RecordDelay(const size_t traffic_class, const Clock::duration delay) {
+    ClassStats &stats = stats_.at(traffic_class);
+    stats.frames++;
+    if (delay <= Clock::duration::zero()) return;
+    stats.delayed++;
+    stats.total_delay += delay;
+    stats.max_delay = std::max(stats.max_delay, delay);
+}
+
+TrafficShaper::Stats TrafficShaper::GetStats(const size_t traffic_class) const {
+    const ClassStats &stats = stats_.at(traffic_class);
+    using Milliseconds = std::chrono::duration<double, std::milli>;
+    return {stats.frames, stats.delayed,
+            stats.delayed > 0 ? Milliseconds(stats.total_delay).count() / stats.delayed : 0.0,
+            Milliseconds(stats.max_delay).count()};
+}
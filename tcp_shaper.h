@@ -0,0 +1,69 @@
+//
+// Token bucket traffic shaping for the send pipeline.
+//
+
+#ifndef TCP_SHAPER_H
+#define TCP_SHAPER_H
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// One token bucket for the whole link and one per traffic class. A frame may go once both its class
+// bucket and the link bucket hold tokens, then its size is charged to both. Buckets only have to be
+// above zero and are allowed into debt, so frames larger than the burst still go out and the debt is
+// paid off before the class sends again. Buckets without a rate are unlimited.
+// Not thread safe, the connection calls it under its send lock.
+class TrafficShaper {
+public:
+    using Clock = std::chrono::steady_clock;
+    constexpr static size_t kNumClasses = 8;
+    // Link control frames (heartbeats, capabilities) are never held back but count against the link
+    constexpr static size_t kControlClass = kNumClasses;
+
+    // Rates in bytes/s, 0 removes the limit. The bucket starts full. Enabled while any rate is set
+    void SetLinkRate(double bytes_per_sec, double burst_bytes);
+    void SetClassRate(size_t traffic_class, double bytes_per_sec, double burst_bytes);
+    bool Enabled() const { return enabled_; }
+
+    bool Ready(size_t traffic_class, Clock::time_point now);
+    // Earliest time Ready() can return true for the class
+    Clock::time_point ReadyAt(size_t traffic_class, Clock::time_point now);
+    void Consume(size_t traffic_class, size_t bytes);
+
+    struct Stats {
+        uint64_t frames;     // frames sent in the class
+        uint64_t delayed;    // of which had to wait for tokens
+        double mean_delay_ms; // time the delayed frames were held back
+        double max_delay_ms;
+    };
+    // Either takes kControlClass as well
+    void RecordDelay(size_t traffic_class, Clock::duration delay);
+    Stats GetStats(size_t traffic_class) const;
+
+private:
+    struct Bucket {
+        double rate{0};
+        double burst{0};
+        double tokens{0};
+        Clock::time_point updated{};
+        bool Limited() const { return rate > 0; }
+        void Refill(Clock::time_point now);
+        Clock::time_point ReadyAt(Clock::time_point now) const;
+    };
+    struct ClassStats {
+        uint64_t frames{0};
+        uint64_t delayed{0};
+        Clock::duration total_delay{0};
+        Clock::duration max_delay{0};
+    };
+
+    bool enabled_{false};
+    Bucket link_;
+    std::array<Bucket, kNumClasses> classes_;
+    void UpdateEnabled();
+    std::array<ClassStats, kNumClasses + 1> stats_;
+};
+
+#endif // TCP_SHAPER_H
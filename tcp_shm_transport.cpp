@@ -0,0 +1,158 @@
+//
+// Shared memory transport for links between processes on the same host.
+//
+
+#include "tcp_shm_transport.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// Spin this many times before sleeping, a frame is usually published within a few hundred ns.
+// With a single CPU the peer can't make progress while we spin, so go straight to the futex
+const int kSpinCount = std::thread::hardware_concurrency() > 1 ? 4000 : 0;
+
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Shared (not FUTEX_PRIVATE) futex ops since the word lives in a mapping used by two processes.
+// The wait times out so the stop flag is still checked if the peer process goes away
+void FutexWait(std::atomic<uint32_t> &word, const uint32_t value) {
+    timespec timeout{0, 100 * 1000 * 1000};
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, value, &timeout, nullptr, 0);
+}
+
+void FutexWake(std::atomic<uint32_t> &word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// Wait until ready() returns true, false if stop is set first. The waiting flag is raised before
+// ready() is checked again and the peer bumps seq before checking the flag, so either we see
+// the update or the peer sees us waiting and the futex value has changed
+template <typename Ready>
+bool WaitUntil(std::atomic<uint32_t> &seq, std::atomic<uint32_t> &waiting, Ready ready, const std::atomic_bool &stop) {
+    for (int i = 0; i < kSpinCount; i++) {
+        if (ready()) return true;
+        CpuRelax();
+    }
+    while (!stop.load()) {
+        const uint32_t value = seq.load();
+        waiting.store(1);
+        if (ready()) {
+            waiting.store(0);
+            return true;
+        }
+        FutexWait(seq, value);
+        waiting.store(0);
+        if (ready()) return true;
+    }
+    return false;
+}
+
+} // namespace
+
+ShmTransport::ShmTransport(const std::string &name, const bool is_server)
+    : name_(name),
+      is_server_(is_server),
+      segment_(nullptr),
+      tx_ring_(nullptr),
+      rx_ring_(nullptr) {
+
+    if (is_server_) shm_unlink(name_.c_str()); // replace a segment left by a previous server
+    const int fd = shm_open(name_.c_str(), is_server_ ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0660);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open shared memory " + name_ + ": " + std::strerror(errno));
+    }
+    struct stat segment_stat{};
+    if (is_server_ && ftruncate(fd, sizeof(Segment)) < 0) {
+        close(fd);
+        shm_unlink(name_.c_str());
+        throw std::runtime_error("Failed to size shared memory " + name_ + ": " + std::strerror(errno));
+    }
+    if (fstat(fd, &segment_stat) < 0 || static_cast<size_t>(segment_stat.st_size) < sizeof(Segment)) {
+        close(fd);
+        throw std::runtime_error("Shared memory " + name_ + " is not ready");
+    }
+    void *address = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        if (is_server_) shm_unlink(name_.c_str());
+        throw std::runtime_error("Failed to map shared memory " + name_ + ": " + std::strerror(errno));
+    }
+    segment_ = static_cast<Segment *>(address);
+
+    if (is_server_) {
+        // ftruncate zero fills the segment so the rings start empty, publish them with the magic
+        segment_->magic.store(kSegmentMagic);
+    } else if (segment_->magic.load() != kSegmentMagic) {
+        munmap(segment_, sizeof(Segment));
+        throw std::runtime_error("Shared memory " + name_ + " is not initialized");
+    }
+    tx_ring_ = is_server_ ? &segment_->to_client : &segment_->to_server;
+    rx_ring_ = is_server_ ? &segment_->to_server : &segment_->to_client;
+}
+
+ShmTransport::~ShmTransport() {
+    munmap(segment_, sizeof(Segment));
+    if (is_server_) shm_unlink(name_.c_str());
+}
+
+bool ShmTransport::Write(const uint8_t *data, const size_t size, const std::atomic_bool &stop) {
+    Ring &ring = *tx_ring_;
+    uint64_t head = ring.head.load(std::memory_order_relaxed); // only this side moves head
+    auto space = [&ring, &head]() { return kRingSize - (head - ring.tail.load(std::memory_order_acquire)); };
+    size_t written = 0;
+    while (written < size) {
+        if (space() == 0 && !WaitUntil(ring.space_seq, ring.writer_waiting, [&space]() { return space() > 0; }, stop)) {
+            return false;
+        }
+        const size_t count = std::min(size - written, static_cast<size_t>(space()));
+        const size_t offset = head % kRingSize;
+        const size_t first = std::min(count, kRingSize - offset);
+        std::memcpy(ring.data + offset, data + written, first);
+        std::memcpy(ring.data, data + written + first, count - first);
+        written += count;
+        head += count;
+        ring.head.store(head);
+        ring.data_seq.fetch_add(1);
+        if (ring.reader_waiting.load()) FutexWake(ring.data_seq);
+    }
+    return true;
+}
+
+bool ShmTransport::Read(uint8_t *data, const size_t size, const std::atomic_bool &stop) {
+    Ring &ring = *rx_ring_;
+    uint64_t tail = ring.tail.load(std::memory_order_relaxed); // only this side moves tail
+    auto available = [&ring, &tail]() { return ring.head.load(std::memory_order_acquire) - tail; };
+    size_t read = 0;
+    while (read < size) {
+        if (available() == 0 && !WaitUntil(ring.data_seq, ring.reader_waiting, [&available]() { return available() > 0; }, stop)) {
+            return false;
+        }
+        const size_t count = std::min(size - read, static_cast<size_t>(available()));
+        const size_t offset = tail % kRingSize;
+        const size_t first = std::min(count, kRingSize - offset);
+        std::memcpy(data + read, ring.data + offset, first);
+        std::memcpy(data + read + first, ring.data, count - first);
+        read += count;
+        tail += count;
+        ring.tail.store(tail);
+        ring.space_seq.fetch_add(1);
+        if (ring.writer_waiting.load()) FutexWake(ring.space_seq);
+    }
+    return true;
+}
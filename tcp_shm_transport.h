@@ -0,0 +1,59 @@
+//
+// Shared memory transport for links between processes on the same host.
+//
+
+#ifndef TCP_SHM_TRANSPORT_H
+#define TCP_SHM_TRANSPORT_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// A POSIX shared memory segment holding one single producer/single consumer byte ring per
+// direction. The rings carry the same TCPProtocol frames as the sockets, so the connection's
+// decoder is unchanged. Idle readers and writers spin briefly then sleep on a futex in the
+// segment, so a busy link hands frames over without entering the kernel.
+class ShmTransport {
+public:
+    // The server creates (replacing any stale segment) and owns the segment, the client
+    // attaches to it. Throws std::runtime_error if the segment can't be created or opened
+    ShmTransport(const std::string &name, bool is_server);
+    ~ShmTransport();
+    ShmTransport(const ShmTransport&) = delete;
+    ShmTransport& operator=(const ShmTransport&) = delete;
+
+    // Block until all bytes are written or read, returns false if stop was set first
+    bool Write(const uint8_t *data, size_t size, const std::atomic_bool &stop);
+    bool Read(uint8_t *data, size_t size, const std::atomic_bool &stop);
+
+    // Larger than the biggest frame (2^16 args) so a writer never waits on a partial frame
+    constexpr static size_t kRingSize = 1 << 21;
+    constexpr static uint32_t kSegmentMagic = 0x53484D52; // "SHMR"
+
+private:
+    // head and tail count the bytes written/read since creation, the futex words are bumped
+    // after every move of head (data) or tail (space) so sleepers can't miss a wakeup
+    struct Ring {
+        alignas(64) std::atomic<uint64_t> head;
+        alignas(64) std::atomic<uint64_t> tail;
+        alignas(64) std::atomic<uint32_t> data_seq;
+        std::atomic<uint32_t> reader_waiting;
+        alignas(64) std::atomic<uint32_t> space_seq;
+        std::atomic<uint32_t> writer_waiting;
+        alignas(64) uint8_t data[kRingSize];
+    };
+    struct Segment {
+        std::atomic<uint32_t> magic; // set once both rings are initialized
+        Ring to_client;
+        Ring to_server;
+    };
+
+    std::string name_;
+    bool is_server_;
+    Segment *segment_;
+    Ring *tx_ring_;
+    Ring *rx_ring_;
+};
+
+#endif // TCP_SHM_TRANSPORT_H
@@ -0,0 +1,256 @@
+//
+// Simulated in-process link with network impairments, for testing.
+//
+
+#include "tcp_sim_transport.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// Of the waiters due at the same time sleeps expire first, so eg. a heartbeat due with a read timeout
+// is sent before the timeout is taken, then the server's reads and then the client's
+constexpr int kSleepRank = 0;
+constexpr int kReadRank = 1; // plus the direction
+
+} // namespace
+
+std::shared_ptr<SimLink> SimLink::Open(const std::string &name) {
+    static std::mutex registry_mutex;
+    static std::map<std::string, std::weak_ptr<SimLink>> registry;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    std::shared_ptr<SimLink> link = registry[name].lock();
+    if (!link) {
+        link = std::make_shared<SimLink>();
+        registry[name] = link;
+    }
+    return link;
+}
+
+void SimLink::SetImpairments(const Direction direction, const Impairments &impairments) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    channels_[direction].impairments = impairments;
+}
+
+void SimLink::SetSeed(const uint64_t seed) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    channels_[kToServer].rng.seed(seed);
+    channels_[kToClient].rng.seed(seed ^ 0x9E3779B97F4A7C15ULL);
+}
+
+void SimLink::ScheduleDisconnect(const Duration at, const Duration duration) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    outages_.emplace(at, duration);
+}
+
+SimLink::Duration SimLink::Now() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return now_;
+}
+
+void SimLink::Advance(const Duration duration) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const Duration target = now_ + duration;
+    while (true) {
+        // Poll as well, a participant which was stopped leaves without going through the link
+        while (!Settled()) settled_.wait_for(lock, std::chrono::milliseconds(100));
+        if (Waiter *due = NextDue()) {
+            due->expired = true;
+            frame_available_.notify_all();
+            continue;
+        }
+        if (now_ >= target) break;
+        AdvanceTo(NextEvent(target));
+        frame_available_.notify_all();
+    }
+}
+
+SimLink::Stats SimLink::GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void SimLink::AdvanceTo(const Duration time) {
+    if (!outages_.empty() && outages_.begin()->first <= time) {
+        const auto outage = *outages_.begin();
+        outages_.erase(outages_.begin());
+        now_ = std::max(now_, outage.first);
+        if (now_ >= down_until_) {
+            Drop();
+            stats_.disconnects++;
+        }
+        down_until_ = std::max(down_until_, now_ + outage.second);
+        return;
+    }
+    now_ = std::max(now_, time);
+}
+
+void SimLink::Drop() {
+    for (auto &channel : channels_) {
+        stats_.lost += channel.frames.size();
+        channel.frames.clear();
+        channel.offset = 0;
+        channel.tx_free_at = now_;
+        channel.last_delivery = now_;
+    }
+    session_++;
+    frame_available_.notify_all();
+}
+
+void SimLink::AddParticipant() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    participants_++;
+}
+
+void SimLink::RemoveParticipant() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    participants_--;
+    settled_.notify_all();
+}
+
+void SimLink::Block() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    blocked_++;
+    settled_.notify_all();
+}
+
+void SimLink::Unblock() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    blocked_--;
+}
+
+bool SimLink::Settled() const {
+    size_t waiting = blocked_;
+    for (const Waiter *waiter : waiters_) {
+        if (!waiter->done() && !waiter->expired) waiting++;
+    }
+    return waiting >= participants_;
+}
+
+SimLink::Waiter *SimLink::NextDue() const {
+    Waiter *due = nullptr;
+    for (Waiter *waiter : waiters_) {
+        if (waiter->expired || waiter->until > now_ || waiter->done()) continue;
+        if (!due || waiter->rank < due->rank) due = waiter;
+    }
+    return due;
+}
+
+SimLink::Duration SimLink::NextEvent(const Duration limit) const {
+    Duration next = limit;
+    auto consider = [this, &next](const Duration time) {
+        if (time > now_) next = std::min(next, time);
+    };
+    for (const auto &channel : channels_) {
+        if (!channel.frames.empty()) consider(channel.frames.front().deliver_at);
+    }
+    for (const Waiter *waiter : waiters_) consider(waiter->until);
+    if (!outages_.empty()) consider(outages_.begin()->first);
+    consider(down_until_);
+    return next;
+}
+
+void SimLink::Wait(std::unique_lock<std::mutex> &lock, Waiter waiter) {
+    waiters_.push_back(&waiter);
+    settled_.notify_all();
+    // Rechecking now and then, stop is set without notifying the link
+    while (!waiter.done() && !waiter.expired) frame_available_.wait_for(lock, std::chrono::milliseconds(100));
+    waiters_.erase(std::find(waiters_.begin(), waiters_.end(), &waiter));
+}
+
+uint64_t SimLink::WaitUp(const std::atomic_bool &stop) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // The link comes back once Advance() reaches the end of the outage
+    Wait(lock, {[this, &stop] { return stop.load() || now_ >= down_until_; }, Duration::max(), kSleepRank, false});
+    return stop.load() ? 0 : session_;
+}
+
+SimLink::ReadResult SimLink::Read(const Direction direction, uint8_t *data, const size_t size, const uint64_t session,
+                                  const std::atomic_bool &stop, const Duration timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Channel &channel = channels_[direction];
+    const Duration deadline = timeout >= Duration::max() - now_ ? Duration::max() : now_ + timeout;
+    auto dropped = [this, session, &stop] { return stop.load() || session != session_; };
+    auto frame_due = [this, &channel] { return !channel.frames.empty() && channel.frames.front().deliver_at <= now_; };
+    size_t copied = 0;
+    while (copied < size) {
+        if (!frame_due() && !dropped()) {
+            Wait(lock, {[&] { return frame_due() || dropped(); }, deadline, kReadRank + direction, false});
+        }
+        if (dropped()) return kDropped;
+        if (!frame_due()) return kTimedOut;
+        Frame &frame = channel.frames.front();
+        const size_t bytes = std::min(size - copied, frame.bytes.size() - channel.offset);
+        std::memcpy(data + copied, frame.bytes.data() + channel.offset, bytes);
+        copied += bytes;
+        channel.offset += bytes;
+        if (channel.offset == frame.bytes.size()) {
+            channel.frames.pop_front();
+            channel.offset = 0;
+        }
+    }
+    return kRead;
+}
+
+bool SimLink::SleepFor(const Duration duration, const uint64_t session, const std::atomic_bool &stop) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto dropped = [this, session, &stop] { return stop.load() || session != session_; };
+    Wait(lock, {dropped, now_ + duration, kSleepRank, false});
+    return !dropped();
+}
+
+void SimLink::Close(const uint64_t session, const Duration down_for) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (session != session_) return; // already dropped
+    Drop();
+    stats_.closed++;
+    down_until_ = std::max(down_until_, now_ + down_for);
+}
+
+bool SimLink::Write(const Direction direction, const uint8_t *data, const size_t size, const uint64_t session) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (session != session_) {
+        stats_.lost++;
+        return false;
+    }
+    Channel &channel = channels_[direction];
+    const Impairments &impairments = channel.impairments;
+    Frame frame{Duration(0), std::vector<uint8_t>(data, data + size)};
+
+    if (impairments.bit_error_rate > 0) {
+        // Skip from one flipped bit to the next instead of drawing for every bit
+        std::geometric_distribution<uint64_t> gap(std::min(impairments.bit_error_rate, 1.0));
+        bool flipped = false;
+        for (uint64_t bit = gap(channel.rng); bit < size * 8; bit += 1 + gap(channel.rng)) {
+            frame.bytes[bit / 8] ^= static_cast<uint8_t>(1 << (bit % 8));
+            flipped = true;
+        }
+        if (flipped) stats_.corrupted++;
+    }
+    if (impairments.loss_rate > 0 && std::bernoulli_distribution(std::min(impairments.loss_rate, 1.0))(channel.rng)) {
+        frame.bytes.clear();
+        stats_.lost++;
+    } else if (impairments.truncate_rate > 0 && size > 0 &&
+        std::bernoulli_distribution(std::min(impairments.truncate_rate, 1.0))(channel.rng)) {
+        frame.bytes.resize(std::uniform_int_distribution<size_t>(0, size - 1)(channel.rng));
+        stats_.truncated++;
+    }
+
+    // The whole frame takes up the bandwidth, even if it arrives cut short
+    Duration transmit(0);
+    if (impairments.bytes_per_sec > 0) transmit = Duration(static_cast<int64_t>(size * 1e9 / impairments.bytes_per_sec));
+    channel.tx_free_at = std::max(now_, channel.tx_free_at) + transmit;
+    Duration jitter(0);
+    if (impairments.jitter > Duration(0)) {
+        jitter = Duration(std::uniform_int_distribution<int64_t>(0, impairments.jitter.count())(channel.rng));
+    }
+    frame.deliver_at = std::max(channel.last_delivery, channel.tx_free_at + impairments.latency + jitter);
+    channel.last_delivery = frame.deliver_at;
+
+    stats_.frames++;
+    stats_.bytes += size;
+    if (!frame.bytes.empty()) channel.frames.push_back(std::move(frame));
+    frame_available_.notify_all();
+    return true;
+}
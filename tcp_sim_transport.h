@@ -0,0 +1,139 @@
+//
+// Simulated in-process link with network impairments, for testing.
+//
+
+#ifndef TCP_SIM_TRANSPORT_H
+#define TCP_SIM_TRANSPORT_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+// Both ends of a link in one process, exchanging the same TCPProtocol frames as a socket. Each direction
+// delays, loses, corrupts and truncates frames as configured, and the link drops at scheduled times,
+// dropping everything in flight, and comes back after the outage.
+//
+// Time on the link is virtual and only moves in Advance(). It steps from one event to the next (a frame
+// falling due, a heartbeat or read timeout of an end, an outage starting or ending) and before each step
+// waits until the threads of both ends have done everything they can at the current time, so frames are
+// stamped with the time they were written no matter how the threads were scheduled. The random draws come
+// from a seeded generator per direction, so the same seed and the same calls between Advance()s give the
+// same run every time. The timing is that of the commands written, batching and conflation depend on how
+// commands queue up behind the send thread and dispatcher threads aren't tracked, leave them off for
+// reproducible runs. Measure with Now(), not the wall clock.
+class SimLink {
+public:
+    using Duration = std::chrono::nanoseconds;
+    enum Direction { kToServer = 0, kToClient = 1 };
+
+    struct Impairments {
+        Duration latency{0};
+        Duration jitter{0};          // uniform extra delay up to this, frames stay in order like a stream
+        double bytes_per_sec{0};     // 0 is unlimited
+        double bit_error_rate{0};    // probability each bit is flipped
+        double truncate_rate{0};     // probability a frame is cut short at a random byte
+        double loss_rate{0};         // probability a frame never arrives, like a stalled path
+    };
+    struct Stats {
+        uint64_t frames;      // written while the link was up
+        uint64_t bytes;
+        uint64_t corrupted;   // with at least one flipped bit
+        uint64_t truncated;
+        uint64_t lost;        // lost on the way, in flight at a disconnect or written while the link was down
+        uint64_t disconnects; // scheduled outages
+        uint64_t closed;      // sessions an end closed, eg. after a read timeout
+    };
+    enum ReadResult { kRead, kDropped, kTimedOut };
+
+    // The link named "<name>.<port>", the ends of a connection to "sim:<name>" share it. Created on
+    // first use and kept while anyone holds it, so a test can configure it before starting the ends
+    static std::shared_ptr<SimLink> Open(const std::string &name);
+
+    void SetImpairments(Direction direction, const Impairments &impairments);
+    // Reseed the generators of both directions
+    void SetSeed(uint64_t seed);
+    // Drop the link at virtual time at, for duration
+    void ScheduleDisconnect(Duration at, Duration duration);
+    Duration Now() const;
+    // Run the ends for duration of virtual time, returns once they are done with everything due by then
+    void Advance(Duration duration);
+    Stats GetStats() const;
+
+    // Used by the connection. The clock only moves while every participant is waiting on the link or
+    // blocked. A thread is added by whoever starts it, before it starts, and removes itself when done.
+    // Block() marks a participant as waiting outside the link for another participant (or the caller
+    // of Advance) to wake it, and whoever wakes it calls Unblock() before the wakeup is visible
+    void AddParticipant();
+    void RemoveParticipant();
+    void Block();
+    void Unblock();
+    // WaitUp returns the session the link is in once it is up, 0 if stop was set. Read blocks until all
+    // bytes are read or timeout passes without a frame arriving, Write never blocks. Both fail once the
+    // session has been dropped (or stop was set), the end then waits for the link to come up again.
+    // SleepFor waits out duration, false if the session was dropped first. Close drops the session from
+    // an end and keeps the link down for down_for, as the end takes that long to reconnect
+    uint64_t WaitUp(const std::atomic_bool &stop);
+    ReadResult Read(Direction direction, uint8_t *data, size_t size, uint64_t session, const std::atomic_bool &stop,
+                    Duration timeout = Duration::max());
+    bool Write(Direction direction, const uint8_t *data, size_t size, uint64_t session);
+    bool SleepFor(Duration duration, uint64_t session, const std::atomic_bool &stop);
+    void Close(uint64_t session, Duration down_for);
+
+private:
+    struct Frame {
+        Duration deliver_at;
+        std::vector<uint8_t> bytes;
+    };
+    struct Channel {
+        Impairments impairments;
+        std::mt19937_64 rng;
+        std::deque<Frame> frames;
+        size_t offset{0};       // read position in the front frame
+        Duration tx_free_at{0}; // when the bandwidth is free for the next frame
+        Duration last_delivery{0};
+    };
+    // A participant waiting on the link until done() holds, or until Advance() expires it once the clock
+    // has reached until. Waiters due at the same time expire one at a time in rank order
+    struct Waiter {
+        std::function<bool()> done;
+        Duration until;
+        int rank;
+        bool expired;
+    };
+
+    // Called holding mutex_. Move the clock to time, stopping at the start of any outage on the way
+    void AdvanceTo(Duration time);
+    void Drop();
+    void Wait(std::unique_lock<std::mutex> &lock, Waiter waiter);
+    // Called holding mutex_. True once no participant can do anything more at the current time
+    bool Settled() const;
+    // The first waiter to expire at the current time, if any
+    Waiter *NextDue() const;
+    Duration NextEvent(Duration limit) const;
+
+    mutable std::mutex mutex_;
+    std::condition_variable frame_available_; // the clock moved or a frame was written
+    std::condition_variable settled_;         // a participant started waiting, blocked or left
+    Duration now_{0};
+    Duration down_until_{0};
+    uint64_t session_{1};
+    std::multimap<Duration, Duration> outages_; // start, duration
+    std::array<Channel, 2> channels_;
+    size_t participants_{0};
+    size_t blocked_{0};
+    std::vector<Waiter *> waiters_;
+    Stats stats_{};
+};
+
+#endif // TCP_SIM_TRANSPORT_H
@@ -0,0 +1,92 @@
+//
+// Per consumer subscription queues for the receive stream.
+//
+
+#include "tcp_subscription.h"
+
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// The ring is private to the process, wakeups come from the connection's receive thread
+void FutexWait(std::atomic<uint32_t> &word, const uint32_t value, const std::chrono::nanoseconds timeout) {
+    const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+    timespec ts{static_cast<time_t>(seconds.count()), static_cast<long>((timeout - seconds).count())};
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT_PRIVATE, value, &ts, nullptr, 0);
+}
+
+void FutexWake(std::atomic<uint32_t> &word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+size_t RoundUpPow2(const size_t value) {
+    size_t size = 1;
+    while (size < value) size <<= 1;
+    return size;
+}
+
+} // namespace
+
+Subscription::Subscription(const uint16_t first, const uint16_t last, Predicate predicate, const size_t capacity)
+    : first_(first),
+      last_(last),
+      predicate_(std::move(predicate)),
+      mask_(RoundUpPow2(capacity == 0 ? 1 : capacity) - 1),
+      slots_(new Ptr[mask_ + 1]) {}
+
+bool Subscription::Push(const Ptr &cmd) {
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) > mask_) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    slots_[head & mask_] = cmd;
+    head_.store(head + 1, std::memory_order_release);
+    // The reader raises the waiting flag before checking head again, so either it sees the new
+    // head or we see it waiting, and the bumped sequence keeps it from sleeping
+    data_seq_.fetch_add(1);
+    if (reader_waiting_.load()) FutexWake(data_seq_);
+    return true;
+}
+
+Subscription::Ptr Subscription::TryRead() {
+    const uint64_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) return nullptr;
+    Ptr cmd = std::move(slots_[tail & mask_]);
+    tail_.store(tail + 1, std::memory_order_release);
+    return cmd;
+}
+
+Subscription::Ptr Subscription::Read(const std::chrono::milliseconds timeout) {
+    using Clock = std::chrono::steady_clock;
+    // A timeout past the end of the clock, eg. milliseconds::max() to wait for ever, would overflow it
+    const auto now = Clock::now();
+    const auto deadline = timeout >= std::chrono::duration_cast<std::chrono::milliseconds>(Clock::time_point::max() - now)
+        ? Clock::time_point::max() : now + timeout;
+    while (true) {
+        if (Ptr cmd = TryRead()) return cmd;
+        const uint32_t value = data_seq_.load();
+        reader_waiting_.store(1);
+        if (Ptr cmd = TryRead()) {
+            reader_waiting_.store(0);
+            return cmd;
+        }
+        const auto remaining = deadline - std::chrono::steady_clock::now();
+        if (closed_.load() || remaining <= std::chrono::steady_clock::duration::zero()) {
+            reader_waiting_.store(0);
+            return nullptr;
+        }
+        FutexWait(data_seq_, value, remaining);
+        reader_waiting_.store(0);
+    }
+}
+
+void Subscription::Close() {
+    closed_.store(true);
+    data_seq_.fetch_add(1);
+    FutexWake(data_seq_);
+}
@@ -0,0 +1,69 @@
+//
+// Per consumer subscription queues for the receive stream.
+//
+
+#ifndef TCP_SUBSCRIPTION_H
+#define TCP_SUBSCRIPTION_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include "tcp_protocol.h"
+
+// A consumer's share of a connection's received commands, the codes in [first, last] which also pass
+// the optional predicate. Each subscription has its own bounded single producer/single consumer ring
+// of shared, immutable commands: the connection's receive thread pushes and one consumer thread reads,
+// neither takes a lock. A command matching several subscriptions is decoded once and each ring holds a
+// reference to it. If a ring is full the command is dropped for that subscriber only and counted.
+class Subscription {
+public:
+    using Predicate = std::function<bool(const Command&)>;
+    using Ptr = std::shared_ptr<const Command>;
+
+    // capacity is rounded up to a power of two. Use TCPConnection::Subscribe() to create one
+    Subscription(uint16_t first, uint16_t last, Predicate predicate, size_t capacity);
+    Subscription(const Subscription&) = delete;
+    Subscription& operator=(const Subscription&) = delete;
+
+    // Next command, waiting at most timeout for one. nullptr if none arrived in time or the
+    // subscription was closed and drained
+    Ptr Read(std::chrono::milliseconds timeout);
+    Ptr TryRead();
+    size_t Size() const { return head_.load() - tail_.load(); }
+    // Commands dropped because the ring was full
+    uint64_t GetDropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    // Stop receiving, matching commands go to the next subscription or the receive buffer instead.
+    // Wakes a blocked Read(), which returns what is left in the ring
+    void Close();
+    bool IsClosed() const { return closed_.load(); }
+
+private:
+    friend class TCPConnection;
+    friend class SubscriptionTest; // pushes like the receive thread
+    bool Matches(const Command &cmd) const {
+        return cmd.command >= first_ && cmd.command <= last_ && (!predicate_ || predicate_(cmd));
+    }
+    // Called by the connection's receive thread only, returns false if the command was dropped
+    bool Push(const Ptr &cmd);
+
+    uint16_t first_;
+    uint16_t last_;
+    Predicate predicate_;
+    size_t mask_;
+    std::unique_ptr<Ptr[]> slots_;
+
+    // head and tail count the commands pushed/read since creation, data_seq is bumped after
+    // every push (and on close) so a sleeping reader can't miss the wakeup
+    alignas(64) std::atomic<uint64_t> head_{0};
+    alignas(64) std::atomic<uint64_t> tail_{0};
+    alignas(64) std::atomic<uint32_t> data_seq_{0};
+    std::atomic<uint32_t> reader_waiting_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic_bool closed_{false};
+};
+
+#endif // TCP_SUBSCRIPTION_H
@@ -0,0 +1,139 @@
+//
+// CPU placement, scheduling and CPU time accounting of the library's threads.
+//
+
+#include "tcp_threads.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sched.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+struct Registry {
+    std::mutex mutex;
+    std::map<std::string, ThreadControl::Settings> settings;
+    struct Thread {
+        std::string name;
+        pthread_t handle;
+    };
+    std::map<pid_t, Thread> running;
+    std::map<std::string, ThreadControl::Stats> exited;
+};
+
+Registry& GetRegistry() {
+    static Registry registry;
+    return registry;
+}
+
+double Seconds(const timeval &time) {
+    return static_cast<double>(time.tv_sec) + static_cast<double>(time.tv_usec) * 1e-6;
+}
+
+// The scheduler's context switch counts of a running thread
+void ReadSwitches(const pid_t tid, ThreadControl::Stats &stats) {
+    std::ifstream status("/proc/self/task/" + std::to_string(tid) + "/status");
+    std::string key;
+    uint64_t value;
+    while (status >> key) {
+        if (key == "voluntary_ctxt_switches:" && status >> value) stats.voluntary_switches += value;
+        else if (key == "nonvoluntary_ctxt_switches:" && status >> value) stats.involuntary_switches += value;
+    }
+}
+
+} // namespace
+
+void ThreadControl::Configure(const std::string &name, const Settings &settings) {
+    const long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (const int cpu : settings.cpus) {
+        if (cpu < 0 || cpu >= num_cpus || cpu >= CPU_SETSIZE) {
+            throw std::invalid_argument("CPU " + std::to_string(cpu) + " does not exist");
+        }
+    }
+    if (settings.fifo_priority < 0 || settings.fifo_priority > sched_get_priority_max(SCHED_FIFO)) {
+        throw std::invalid_argument("SCHED_FIFO priority must be 1-" + std::to_string(sched_get_priority_max(SCHED_FIFO)));
+    }
+    Registry &registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.settings[name] = settings;
+}
+
+bool ThreadControl::LockMemory() {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        std::cerr << "Failed to lock memory: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::vector<ThreadControl::Stats> ThreadControl::GetStats() {
+    Registry &registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    std::map<std::string, Stats> stats = registry.exited;
+    // A thread unregisters under the lock before exiting, so the handles are all valid here
+    for (const auto &thread : registry.running) {
+        Stats &entry = stats[thread.second.name];
+        entry.name = thread.second.name;
+        entry.threads++;
+        clockid_t clock;
+        timespec cpu_time{};
+        if (pthread_getcpuclockid(thread.second.handle, &clock) == 0 && clock_gettime(clock, &cpu_time) == 0) {
+            entry.cpu_seconds += static_cast<double>(cpu_time.tv_sec) + static_cast<double>(cpu_time.tv_nsec) * 1e-9;
+        }
+        ReadSwitches(thread.first, entry);
+    }
+    std::vector<Stats> report;
+    for (auto &entry : stats) report.push_back(std::move(entry.second));
+    return report;
+}
+
+ThreadControl::Scope::Scope(const std::string &role, const uint16_t port)
+    : name_(port == 0 ? role : role + ":" + std::to_string(port)),
+      tid_(static_cast<pid_t>(syscall(SYS_gettid))) {
+    // Thread names are limited to 15 characters
+    pthread_setname_np(pthread_self(), name_.substr(0, 15).c_str());
+
+    Registry &registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    auto settings = registry.settings.find(name_);
+    if (settings == registry.settings.end()) settings = registry.settings.find(role);
+    if (settings != registry.settings.end()) {
+        if (!settings->second.cpus.empty()) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            for (const int cpu : settings->second.cpus) CPU_SET(cpu, &cpus);
+            const int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+            if (error != 0) std::cerr << "Failed to pin thread " << name_ << ": " << std::strerror(error) << std::endl;
+        }
+        if (settings->second.fifo_priority > 0) {
+            sched_param param{};
+            param.sched_priority = settings->second.fifo_priority;
+            const int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+            if (error != 0) std::cerr << "Failed to make thread " << name_ << " SCHED_FIFO: " << std::strerror(error) << std::endl;
+        }
+    }
+    registry.running[tid_] = {name_, pthread_self()};
+}
+
+ThreadControl::Scope::~Scope() {
+    rusage usage{};
+    getrusage(RUSAGE_THREAD, &usage);
+    Registry &registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    Stats &entry = registry.exited[name_];
+    entry.name = name_;
+    entry.cpu_seconds += Seconds(usage.ru_utime) + Seconds(usage.ru_stime);
+    entry.voluntary_switches += usage.ru_nvcsw;
+    entry.involuntary_switches += usage.ru_nivcsw;
+    registry.running.erase(tid_);
+}
@@ -0,0 +1,63 @@
+//
+// CPU placement, scheduling and CPU time accounting of the library's threads.
+//
+
+#ifndef TCP_THREADS_H
+#define TCP_THREADS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sys/types.h>
+
+// Each thread the connections start runs under a name made of its role and the link's port, eg.
+// "send:50000". The roles are
+//   "send"       the send thread of a link
+//   "recv"       the receive thread of shm: and sim: links
+//   "heartbeat"  the heartbeat thread of a server link
+//   "io"         threads running an io_context, which handles the socket reads and timers (see Scope)
+// Settings given for a name apply to that thread, otherwise those of its role do. The name is also
+// set as the thread's name so it shows up in top -H, perf and the GetStats() report.
+class ThreadControl {
+public:
+    struct Settings {
+        std::vector<int> cpus; // CPUs the thread may run on, empty leaves it unpinned
+        int fifo_priority{0};  // 1-99 runs it SCHED_FIFO at this priority, 0 leaves the default policy
+    };
+    // CPU time used so far by the threads with a name, including those which have exited,
+    // and how often they blocked (voluntary) or were preempted (involuntary)
+    struct Stats {
+        std::string name;
+        size_t threads;  // running now
+        double cpu_seconds;
+        uint64_t voluntary_switches;
+        uint64_t involuntary_switches;
+    };
+
+    // Configure before the links start, threads read their settings when they start.
+    // Throws std::invalid_argument if a cpu or the priority is out of range
+    static void Configure(const std::string &name, const Settings &settings);
+    // Lock the process' current and future pages in memory so a page fault can't stall a real time
+    // thread. Returns false (and logs why) if it isn't permitted, eg. without CAP_IPC_LOCK
+    static bool LockMemory();
+    static std::vector<Stats> GetStats();
+
+    // Applies the settings to the calling thread and counts it in the stats while in scope. Failing to
+    // apply a setting, usually SCHED_FIFO without CAP_SYS_NICE, is logged and the thread runs without it.
+    // The library only starts an io thread from Python, an application running io_context::run() on its
+    // own threads should open a Scope("io") at the top of each so they can be pinned and show in the stats
+    class Scope {
+    public:
+        explicit Scope(const std::string &role, uint16_t port = 0);
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        std::string name_;
+        pid_t tid_;
+    };
+};
+
+#endif // TCP_THREADS_H
@@ -62,20 +62,29 @@ int main(int argc, char* argv[]) {
     cmd_client = std::make_shared<TCPConnection>(io_context, ip_address, cmd_port, false, true, false);
     std::shared_ptr<TCPConnection> monitor_client;
     monitor_client = std::make_shared<TCPConnection>(io_context, ip_address, monitor_port, false, false, true);
+    // The status words barely change between periods, delta compress them if the server supports it
+    monitor_client->SetCapabilities(TCPProtocol::kCapCompression);
+    monitor_client->EnableCompression(0xFFF);
+    // Only the latest status matters, a slow or reconnecting link sends that instead of a backlog
+    monitor_client->EnableConflation(0xFFF);
     cmd_client->Start();
     monitor_client->Start();
     std::cout << "Starting IO Context..." << std::endl;
 
     // Guard to keep IO contex from completely before we want to quit
     asio::executor_work_guard<asio::io_context::executor_type> work_guard(io_context.get_executor());
-    std::thread io_thread([&]() { io_context.run(); });
-    std::thread io_thread2([&]() { io_context.run(); });
+    std::thread io_thread([&]() { ThreadControl::Scope scope("io"); io_context.run(); });
+    std::thread io_thread2([&]() { ThreadControl::Scope scope("io"); io_context.run(); });
 
+    // Sleep on both links instead of polling, waking when a command arrives or the next send is due
+    ConnectionPoller poller({cmd_client, monitor_client});
     while (keepRunning.load()) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        poller.Wait(std::chrono::milliseconds(std::max<int64_t>(0, send_period - elapsed + 1)));
+
         // Get the current time, we want to check so we can send fake monitoring data at 1Hz
         auto now = std::chrono::steady_clock::now();
-        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count();
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count();
 
         // If a command is received
         if (cmd_client->DataInRecvBuffer()) {
@@ -0,0 +1,180 @@
+//
+// Loopback benchmark for the command link.
+//
+// A server and client connection are created in the same process. The server sends requests and
+// the client acks each one, per the command link specification, so every request is a full round
+// trip through the socket, decoder and send threads. Run it once per build, eg. with and without
+// -DNETWORK_IO_URING=ON, to compare the backends, or with a ZeroCopyBytes threshold for the
+// server's MSG_ZEROCOPY sends. Syscalls of every thread are counted with the raw_syscalls:sys_enter
+// tracepoint, which needs tracefs mounted and perf_event_paranoid <= 1 (or CAP_PERFMON). Without it
+// only the read and write family calls in /proc/self/io are counted, which asio's sendmsg/recvmsg
+// and io_uring_enter don't show up in
+//
+
+#include "../tcp_connection.h"
+#include <algorithm>
+#include <fstream>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+constexpr uint16_t kBenchmarkCmd = 0xBE;
+
+struct ProcessStats {
+    double cpu_ms;
+    long voluntary_switches;
+    long involuntary_switches;
+    uint64_t syscalls;
+};
+
+// Counts the syscalls entered by this thread and every thread started after it
+class SyscallCounter {
+public:
+    SyscallCounter() {
+        uint64_t id = 0;
+        for (const char *tracefs : {"/sys/kernel/tracing", "/sys/kernel/debug/tracing"}) {
+            std::ifstream file(std::string(tracefs) + "/events/raw_syscalls/sys_enter/id");
+            if (file >> id) break;
+        }
+        if (id == 0) return;
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.size = sizeof(attr);
+        attr.config = id;
+        attr.inherit = 1;
+        fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+    ~SyscallCounter() { if (fd_ >= 0) close(fd_); }
+    bool Traced() const { return fd_ >= 0; }
+    uint64_t Read() const {
+        uint64_t count = 0;
+        if (fd_ >= 0) {
+            if (read(fd_, &count, sizeof(count)) != sizeof(count)) count = 0;
+            return count;
+        }
+        std::ifstream io("/proc/self/io");
+        std::string key;
+        uint64_t value;
+        while (io >> key >> value) {
+            if (key == "syscr:" || key == "syscw:") count += value;
+        }
+        return count;
+    }
+
+private:
+    int fd_{-1};
+};
+
+// Opened before any thread starts so they all inherit it
+const SyscallCounter &GetSyscallCounter() {
+    static const SyscallCounter counter;
+    return counter;
+}
+
+// CPU time and context switches of every thread in the process
+ProcessStats GetProcessStats() {
+    ProcessStats stats{};
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    stats.cpu_ms = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 +
+                   (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3;
+    stats.voluntary_switches = usage.ru_nvcsw;
+    stats.involuntary_switches = usage.ru_nivcsw;
+    stats.syscalls = GetSyscallCounter().Read();
+    return stats;
+}
+
+void PrintStats(const std::string &label, const ProcessStats &start, const ProcessStats &end,
+                const size_t num_requests, const double elapsed_ms) {
+    std::cout << label << "\n"
+              << "  Rate:            " << num_requests / (elapsed_ms / 1e3) << " req/s\n"
+              << "  CPU per request: " << (end.cpu_ms - start.cpu_ms) * 1e3 / num_requests << " us\n"
+              << "  Ctx switches:    " << static_cast<double>(end.voluntary_switches - start.voluntary_switches) / num_requests
+              << " vol, " << static_cast<double>(end.involuntary_switches - start.involuntary_switches) / num_requests
+              << " invol /req\n"
+              << "  Syscalls:        " << static_cast<double>(end.syscalls - start.syscalls) / num_requests
+              << (GetSyscallCounter().Traced() ? " /req" : " /req (read/write family only)") << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <IP address> <port> Optional: <NumRequests> <NumArgWords> <PipelineDepth> <ZeroCopyBytes>" << std::endl;
+        return 1;
+    }
+
+    std::string ip_address = argv[1];
+    uint16_t port = std::stoi(argv[2]);
+    const size_t num_requests = argc > 3 ? std::stoul(argv[3]) : 10000;
+    const size_t num_words = argc > 4 ? std::stoul(argv[4]) : 10;
+    const size_t pipeline_depth = argc > 5 ? std::stoul(argv[5]) : 64;
+    const size_t zerocopy_bytes = argc > 6 ? std::stoul(argv[6]) : 0;
+    if (!GetSyscallCounter().Traced()) {
+        std::cerr << "raw_syscalls tracepoint unavailable, counting read/write syscalls only" << std::endl;
+    }
+
+    asio::io_context io_context;
+    auto server = std::make_shared<TCPConnection>(io_context, ip_address, port, true, false, false);
+    auto client = std::make_shared<TCPConnection>(io_context, ip_address, port, false, false, false);
+    server->SetZeroCopy(zerocopy_bytes);
+    // Drop the benchmark commands on the client io thread, only the acks matter
+    client->RegisterHandler(kBenchmarkCmd, [](Command &) {}, true);
+
+    server->Start();
+    asio::executor_work_guard<asio::io_context::executor_type> work_guard(io_context.get_executor());
+    std::thread io_thread([&]() { io_context.run(); });
+    client->Start();
+
+    // Wait for the connection, the client sleeps before connecting
+    auto probe = server->SendRequest(Command(kBenchmarkCmd, 0));
+    while (probe.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready) {
+        probe = server->SendRequest(Command(kBenchmarkCmd, 0));
+    }
+
+    // Round trip latency, one request in flight at a time
+    std::vector<double> latency_us;
+    latency_us.reserve(num_requests);
+    auto stats_start = GetProcessStats();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < num_requests; i++) {
+        const auto sent = std::chrono::steady_clock::now();
+        server->SendRequest(Command(kBenchmarkCmd, num_words)).get();
+        latency_us.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent).count());
+    }
+    double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    auto stats_end = GetProcessStats();
+
+    std::sort(latency_us.begin(), latency_us.end());
+    std::cout << "Round trip [" << ip_address << ":" << port << "] " << num_requests << " requests x "
+              << num_words << " words\n"
+              << "  Latency min/median/p99/max: " << latency_us.front() << " / " << latency_us.at(latency_us.size() / 2)
+              << " / " << latency_us.at(latency_us.size() * 99 / 100) << " / " << latency_us.back() << " us" << std::endl;
+    PrintStats("Sequential", stats_start, stats_end, num_requests, elapsed_ms);
+
+    // Throughput with pipeline_depth requests in flight
+    std::deque<std::future<Command>> in_flight;
+    stats_start = GetProcessStats();
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < num_requests; i++) {
+        if (in_flight.size() >= pipeline_depth) {
+            in_flight.front().get();
+            in_flight.pop_front();
+        }
+        in_flight.push_back(server->SendRequest(Command(kBenchmarkCmd, num_words)));
+    }
+    while (!in_flight.empty()) {
+        in_flight.front().get();
+        in_flight.pop_front();
+    }
+    elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    stats_end = GetProcessStats();
+    PrintStats("Pipelined (depth " + std::to_string(pipeline_depth) + ")", stats_start, stats_end, num_requests, elapsed_ms);
+
+    server->setStopCmdRead();
+    client->setStopCmdRead();
+    io_context.stop();
+    io_thread.join();
+    return 0;
+}
@@ -60,7 +60,12 @@ void SendHeartbeat(std::shared_ptr<TCPConnection> &server) {
 }
 
 void MonitorServer(std::shared_ptr<TCPConnection> &cmd_server, std::shared_ptr<TCPConnection> &monitor_server) {
+    // Sleep on both links at once, waking as soon as either receives a command
+    ConnectionPoller poller({monitor_server, cmd_server});
     while (keepRunning.load()) {
+        // The timeout only bounds how long it takes to notice keepRunning going false
+        poller.Wait(std::chrono::milliseconds(100));
+
         if (monitor_server->DataInRecvBuffer()) {
             // If monitoring data is received, read the command and print it
             Command cmd = monitor_server->ReadRecvBuffer();
@@ -93,8 +98,6 @@ void MonitorServer(std::shared_ptr<TCPConnection> &cmd_server, std::shared_ptr<T
                PrintState();
             }
         }
-
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
 }
 
@@ -117,13 +120,14 @@ int main(int argc, char* argv[]) {
     cmd_server = std::make_shared<TCPConnection>(io_context, ip_address, cmd_port, true, false, false);
     std::shared_ptr<TCPConnection> monitor_server;
     monitor_server = std::make_shared<TCPConnection>(io_context, ip_address, monitor_port, true, false, true);
+    monitor_server->SetCapabilities(TCPProtocol::kCapCompression); // accept delta compressed status frames
     cmd_server->Start();
     monitor_server->Start();
     std::cout << "Starting IO Context..." << std::endl;
 
     // Guard to keep IO contex from completely before we want to quit
     asio::executor_work_guard<asio::io_context::executor_type> work_guard(io_context.get_executor());
-    std::thread io_thread([&]() { io_context.run(); });
+    std::thread io_thread([&]() { ThreadControl::Scope scope("io"); io_context.run(); });
     std::thread heartbeat_thread( [&]{SendHeartbeat(cmd_server); } );
     std::thread monitor_thread( [&]{ MonitorServer(cmd_server, monitor_server); } );
 
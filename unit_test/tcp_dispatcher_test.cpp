@@ -0,0 +1,81 @@
+//
+// Unit tests for the parallel command dispatcher.
+//
+
+#include "gtest/gtest.h"
+#include "../tcp_dispatcher.h"
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <stdexcept>
+#include <vector>
+
+using std::chrono::seconds;
+
+static Command MakeCommand(const uint16_t cmd, const uint32_t value) {
+    Command command(cmd, 1);
+    command.arguments[0] = value;
+    return command;
+}
+
+TEST(CommandDispatcherTest, PostWithoutHandler) {
+    CommandDispatcher dispatcher(2);
+    EXPECT_FALSE(dispatcher.Post(MakeCommand(1, 0)));
+}
+
+// The strand runs one handler at a time, so the vector needs no lock
+TEST(CommandDispatcherTest, SameKeyInOrder) {
+    CommandDispatcher dispatcher(4);
+    std::vector<uint32_t> handled;
+    dispatcher.RegisterHandler(1, [&handled](Command &cmd) { handled.push_back(cmd.arguments[0]); });
+    for (uint32_t i = 0; i < 1000; i++) EXPECT_TRUE(dispatcher.Post(MakeCommand(1, i)));
+    dispatcher.Join();
+    ASSERT_EQ(handled.size(), 1000u);
+    for (uint32_t i = 0; i < handled.size(); i++) EXPECT_EQ(handled[i], i);
+}
+
+// The first handler only returns once the second has run, which needs them on different workers
+TEST(CommandDispatcherTest, DifferentKeysInParallel) {
+    CommandDispatcher dispatcher(2);
+    std::promise<void> second_ran;
+    std::future<void> second_done = second_ran.get_future();
+    std::atomic_bool first_saw_second{false};
+    dispatcher.RegisterHandler(1, [&](Command &) {
+        first_saw_second = second_done.wait_for(seconds(5)) == std::future_status::ready;
+    });
+    dispatcher.RegisterHandler(2, [&](Command &) { second_ran.set_value(); });
+    dispatcher.Post(MakeCommand(1, 0));
+    dispatcher.Post(MakeCommand(2, 0));
+    dispatcher.Join();
+    EXPECT_TRUE(first_saw_second);
+}
+
+// Far more keys than strands, each key still sees its commands in order
+TEST(CommandDispatcherTest, KeyFunctionOrdersEachKey) {
+    constexpr uint32_t kKeys = 10000;
+    CommandDispatcher dispatcher(4, [](const Command &cmd) { return cmd.arguments[0] % kKeys; });
+    std::vector<std::atomic<uint32_t>> next(kKeys);
+    std::atomic<uint32_t> out_of_order{0};
+    dispatcher.RegisterHandler(1, [&](Command &cmd) {
+        const uint32_t key = cmd.arguments[0] % kKeys;
+        if (next[key].fetch_add(1) != cmd.arguments[0] / kKeys) out_of_order++;
+    });
+    for (uint32_t i = 0; i < 3 * kKeys; i++) dispatcher.Post(MakeCommand(1, i));
+    dispatcher.Join();
+    EXPECT_EQ(out_of_order.load(), 0u);
+    for (uint32_t key = 0; key < kKeys; key++) EXPECT_EQ(next[key].load(), 3u);
+}
+
+// A handler which throws is logged and the rest of the key's commands still run
+TEST(CommandDispatcherTest, HandlerThrows) {
+    CommandDispatcher dispatcher(1);
+    std::vector<uint32_t> handled;
+    dispatcher.RegisterHandler(1, [&handled](Command &cmd) {
+        if (cmd.arguments[0] == 0) throw std::runtime_error("bad command");
+        handled.push_back(cmd.arguments[0]);
+    });
+    dispatcher.Post(MakeCommand(1, 0));
+    dispatcher.Post(MakeCommand(1, 1));
+    dispatcher.Join();
+    EXPECT_EQ(handled, std::vector<uint32_t>{1});
+}
@@ -4,6 +4,7 @@
 
 #include "gtest/gtest.h"
 #include "../tcp_protocol.h"
+#include "../tcp_codec.h"
 #include <vector>
 #include <cstring>
 #include <cstdint>
@@ -27,7 +28,7 @@ TEST_F(TCPProtocolTest, Constructor) {
     size_t vec_size = 3;
     TCPProtocol protocol(cmd, vec_size);
 
-    EXPECT_EQ(protocol.command_code, cmd);
+    EXPECT_EQ(protocol.command, cmd);
     EXPECT_EQ(protocol.arg_count, vec_size);
     EXPECT_EQ(protocol.arguments.size(), vec_size);
     EXPECT_EQ(protocol.start_code1, TCPProtocol::kStartCode1);
@@ -131,4 +132,315 @@ TEST_F(TCPProtocolTest, SerializeWithArgs) {
     uint16_t received_crc = (serialized_data[serialized_data.size() - 4] << 8) | serialized_data[serialized_data.size() - 3];
     EXPECT_EQ(calculated_crc, received_crc);
 
-}
\ No newline at end of file
+}
+
+// Encode cmd and decode the envelope at the other end, returns the envelope's arg count
+size_t RoundTrip(DeltaCodec &encoder, DeltaCodec &decoder, const Command &cmd) {
+    Command frame = cmd;
+    encoder.Encode(frame);
+    EXPECT_EQ(frame.command, TCPProtocol::kCompressed);
+    const size_t encoded_args = frame.arguments.size();
+    EXPECT_TRUE(decoder.Decode(frame));
+    EXPECT_EQ(frame.command, cmd.command);
+    EXPECT_EQ(frame.arguments, cmd.arguments);
+    return encoded_args;
+}
+
+// The first frame of a code has no reference, repeats of it collapse into a single run
+TEST_F(TCPProtocolTest, DeltaCodecRoundTrip) {
+    DeltaCodec encoder, decoder;
+    Command status(0x10, 64);
+    for (size_t i = 0; i < status.arguments.size(); i++) status.arguments[i] = static_cast<uint32_t>(i * 1000);
+
+    EXPECT_LE(RoundTrip(encoder, decoder, status), status.arguments.size() + DeltaCodec::kEnvelopeWords);
+    EXPECT_EQ(RoundTrip(encoder, decoder, status), DeltaCodec::kEnvelopeWords + 1);
+    status.arguments[5]++;
+    status.arguments[40]--;
+    EXPECT_EQ(RoundTrip(encoder, decoder, status), DeltaCodec::kEnvelopeWords + 2);
+}
+
+// Deltas across the wrap and of the largest magnitude either way, which zigzag to the extremes
+TEST_F(TCPProtocolTest, DeltaCodecZigZagEdges) {
+    DeltaCodec encoder, decoder;
+    Command cmd(0x11, 6);
+    cmd.arguments = {0, UINT32_MAX, 0x80000000, 0x7FFFFFFF, 1, 0};
+    RoundTrip(encoder, decoder, cmd);
+    cmd.arguments = {UINT32_MAX, 0, 0x7FFFFFFF, 0x80000000, 0, 1};
+    RoundTrip(encoder, decoder, cmd);
+    cmd.arguments = {0x80000000, 0x7FFFFFFF, 0, UINT32_MAX, 0x80000001, 0x7FFFFFFE};
+    RoundTrip(encoder, decoder, cmd);
+}
+
+// Runs at the start, middle and end, a single unchanged word and frames growing and shrinking
+// against their reference, whose missing words count as 0
+TEST_F(TCPProtocolTest, DeltaCodecRunLengths) {
+    DeltaCodec encoder, decoder;
+    Command cmd(0x12, 300);
+    for (size_t i = 0; i < cmd.arguments.size(); i++) cmd.arguments[i] = static_cast<uint32_t>(i);
+    RoundTrip(encoder, decoder, cmd);
+    cmd.arguments[150] = 7;
+    cmd.arguments[152] = 7;
+    cmd.arguments[299] = 7;
+    RoundTrip(encoder, decoder, cmd);
+    cmd.arguments.resize(400, 0);
+    RoundTrip(encoder, decoder, cmd);
+    cmd.arguments.resize(10);
+    RoundTrip(encoder, decoder, cmd);
+    cmd.arguments.clear();
+    RoundTrip(encoder, decoder, cmd);
+    cmd.arguments.assign(3, 0);
+    RoundTrip(encoder, decoder, cmd);
+}
+
+// Random words don't compress, they are stored as is and still become the next reference
+TEST_F(TCPProtocolTest, DeltaCodecLiteralFallback) {
+    DeltaCodec encoder, decoder;
+    Command cmd(0x13, 32);
+    uint32_t value = 12345;
+    for (auto &arg : cmd.arguments) arg = value = value * 1103515245u + 12345u;
+    EXPECT_EQ(RoundTrip(encoder, decoder, cmd), cmd.arguments.size() + DeltaCodec::kEnvelopeWords);
+    EXPECT_EQ(RoundTrip(encoder, decoder, cmd), DeltaCodec::kEnvelopeWords + 1);
+}
+
+// Each code is delta coded against its own previous frame
+TEST_F(TCPProtocolTest, DeltaCodecCodesIndependent) {
+    DeltaCodec encoder, decoder;
+    Command a(0x20, 8), b(0x21, 8);
+    for (size_t i = 0; i < 8; i++) {
+        a.arguments[i] = static_cast<uint32_t>(i);
+        b.arguments[i] = static_cast<uint32_t>(100 + i);
+    }
+    RoundTrip(encoder, decoder, a);
+    RoundTrip(encoder, decoder, b);
+    a.arguments[0] = 50;
+    RoundTrip(encoder, decoder, a);
+    RoundTrip(encoder, decoder, b);
+}
+
+TEST_F(TCPProtocolTest, DeltaCodecRejectsMalformed) {
+    DeltaCodec encoder, decoder;
+    Command cmd(0x14, 16);
+    for (size_t i = 0; i < cmd.arguments.size(); i++) cmd.arguments[i] = static_cast<uint32_t>(i);
+    Command frame = cmd;
+    encoder.Encode(frame);
+
+    Command not_compressed(0x14, 4);
+    EXPECT_FALSE(decoder.Decode(not_compressed));
+    Command short_envelope(TCPProtocol::kCompressed, DeltaCodec::kEnvelopeWords - 1);
+    EXPECT_FALSE(decoder.Decode(short_envelope));
+    Command bad_mode = frame;
+    bad_mode.arguments[0] |= 7u << 16;
+    EXPECT_FALSE(decoder.Decode(bad_mode));
+    Command too_many_bytes = frame;
+    too_many_bytes.arguments[2] = static_cast<uint32_t>(frame.arguments.size() * sizeof(uint32_t));
+    EXPECT_FALSE(decoder.Decode(too_many_bytes));
+    Command too_many_args = frame;
+    too_many_args.arguments[1] = static_cast<uint32_t>(TCPProtocol::kMaxMessageArgs + 1);
+    EXPECT_FALSE(decoder.Decode(too_many_args));
+    Command truncated = frame;
+    truncated.arguments.resize(DeltaCodec::kEnvelopeWords + 1);
+    EXPECT_FALSE(decoder.Decode(truncated));
+
+    EXPECT_TRUE(decoder.Decode(frame));
+    EXPECT_EQ(frame.arguments, cmd.arguments);
+}
+
+// After a reset both ends start again without references
+TEST_F(TCPProtocolTest, DeltaCodecReset) {
+    DeltaCodec encoder, decoder;
+    Command cmd(0x15, 16);
+    RoundTrip(encoder, decoder, cmd);
+    encoder.Reset();
+    decoder.Reset();
+    cmd.arguments[3] = 9;
+    RoundTrip(encoder, decoder, cmd);
+}
+
+// A command of n args counting up from first
+Command Sequence(const uint16_t cmd, const size_t n, const uint32_t first = 0) {
+    Command command(cmd, n);
+    for (size_t i = 0; i < n; i++) command.arguments[i] = first + static_cast<uint32_t>(i);
+    return command;
+}
+
+TEST_F(TCPProtocolTest, FragmentSplitsAtFrameLimit) {
+    const Command message = Sequence(0x30, 2 * TCPProtocol::kMaxFragmentArgs + 5);
+    for (uint32_t index = 0; index < 3; index++) {
+        const Command fragment = TCPProtocol::Fragment(message, 9, index);
+        EXPECT_EQ(fragment.command, TCPProtocol::kFragment);
+        EXPECT_LE(fragment.arguments.size(), TCPProtocol::kMaxFrameArgs);
+        EXPECT_EQ(fragment.arguments[0], 9u);
+        EXPECT_EQ(fragment.arguments[1], index);
+        EXPECT_EQ(fragment.arguments[2], message.command);
+        EXPECT_EQ(fragment.arguments[3], message.arguments.size());
+        EXPECT_EQ(fragment.arguments[TCPProtocol::kFragmentHeaderWords], index * TCPProtocol::kMaxFragmentArgs);
+    }
+    EXPECT_EQ(TCPProtocol::Fragment(message, 9, 2).arguments.size(), TCPProtocol::kFragmentHeaderWords + 5);
+}
+
+TEST_F(TCPProtocolTest, ReassembleInOrder) {
+    const Command message = Sequence(0x31, 3 * TCPProtocol::kMaxFragmentArgs + 1);
+    Reassembler reassembler;
+    for (uint32_t index = 0; index < 4; index++) {
+        Command fragment = TCPProtocol::Fragment(message, 1, index);
+        EXPECT_EQ(reassembler.Add(fragment), index < 3 ? Reassembler::kPending : Reassembler::kComplete);
+        if (index == 3) {
+            EXPECT_EQ(fragment.command, message.command);
+            EXPECT_EQ(fragment.arguments, message.arguments);
+        }
+    }
+}
+
+// A missing or repeated fragment drops the message, its remaining fragments are discarded
+TEST_F(TCPProtocolTest, ReassembleOutOfOrder) {
+    const Command message = Sequence(0x32, 3 * TCPProtocol::kMaxFragmentArgs);
+    Reassembler reassembler;
+    Command first = TCPProtocol::Fragment(message, 2, 0);
+    Command third = TCPProtocol::Fragment(message, 2, 2);
+    EXPECT_EQ(reassembler.Add(first), Reassembler::kPending);
+    EXPECT_EQ(reassembler.Add(third), Reassembler::kOutOfSequence);
+    Command second = TCPProtocol::Fragment(message, 2, 1);
+    EXPECT_EQ(reassembler.Add(second), Reassembler::kDiscarded);
+
+    first = TCPProtocol::Fragment(message, 3, 0);
+    Command repeat = first;
+    EXPECT_EQ(reassembler.Add(first), Reassembler::kPending);
+    EXPECT_EQ(reassembler.Add(repeat), Reassembler::kInterrupted);
+
+    // A fragment of another message, or one which disagrees with the first on the command or size
+    Command other = TCPProtocol::Fragment(message, 4, 1);
+    EXPECT_EQ(reassembler.Add(other), Reassembler::kOutOfSequence);
+    first = TCPProtocol::Fragment(message, 5, 0);
+    second = TCPProtocol::Fragment(message, 5, 1);
+    second.arguments[2]++;
+    EXPECT_EQ(reassembler.Add(first), Reassembler::kPending);
+    EXPECT_EQ(reassembler.Add(second), Reassembler::kOutOfSequence);
+    first = TCPProtocol::Fragment(message, 6, 0);
+    second = TCPProtocol::Fragment(message, 6, 1);
+    second.arguments[3]--;
+    EXPECT_EQ(reassembler.Add(first), Reassembler::kPending);
+    EXPECT_EQ(reassembler.Add(second), Reassembler::kOutOfSequence);
+
+    // The next message goes through after all that
+    for (uint32_t index = 0; index < 3; index++) {
+        Command fragment = TCPProtocol::Fragment(message, 7, index);
+        EXPECT_EQ(reassembler.Add(fragment), index < 2 ? Reassembler::kPending : Reassembler::kComplete);
+        if (index == 2) {
+            EXPECT_EQ(fragment.arguments, message.arguments);
+        }
+    }
+}
+
+// More args than the first fragment announced, and messages over kMaxMessageArgs
+TEST_F(TCPProtocolTest, ReassembleOversized) {
+    Reassembler reassembler;
+    const Command message = Sequence(0x33, TCPProtocol::kMaxFragmentArgs + 10);
+    Command first = TCPProtocol::Fragment(message, 1, 0);
+    Command second = TCPProtocol::Fragment(message, 1, 1);
+    second.arguments.push_back(0);
+    EXPECT_EQ(reassembler.Add(first), Reassembler::kPending);
+    EXPECT_EQ(reassembler.Add(second), Reassembler::kOutOfSequence);
+
+    Command too_large(TCPProtocol::kFragment, TCPProtocol::kFragmentHeaderWords + 1);
+    too_large.arguments = {2, 0, 0x33, static_cast<uint32_t>(TCPProtocol::kMaxMessageArgs + 1), 0};
+    EXPECT_EQ(reassembler.Add(too_large), Reassembler::kTooLarge);
+    Command rest = too_large;
+    rest.arguments[1] = 1;
+    EXPECT_EQ(reassembler.Add(rest), Reassembler::kDiscarded);
+
+    // Exactly kMaxMessageArgs is allowed
+    Command largest(TCPProtocol::kFragment, TCPProtocol::kFragmentHeaderWords + 1);
+    largest.arguments = {3, 0, 0x33, static_cast<uint32_t>(TCPProtocol::kMaxMessageArgs), 0};
+    EXPECT_EQ(reassembler.Add(largest), Reassembler::kPending);
+
+    Command malformed(TCPProtocol::kFragment, TCPProtocol::kFragmentHeaderWords - 1);
+    EXPECT_EQ(reassembler.Add(malformed), Reassembler::kMalformed);
+}
+
+// A reset discards the message in progress
+TEST_F(TCPProtocolTest, ReassembleReset) {
+    const Command message = Sequence(0x34, TCPProtocol::kMaxFragmentArgs + 1);
+    Reassembler reassembler;
+    Command first = TCPProtocol::Fragment(message, 1, 0);
+    Command second = TCPProtocol::Fragment(message, 1, 1);
+    EXPECT_EQ(reassembler.Add(first), Reassembler::kPending);
+    reassembler.Reset();
+    EXPECT_EQ(reassembler.Add(second), Reassembler::kDiscarded);
+}
+
+TEST_F(TCPProtocolTest, BatchRoundTrip) {
+    std::vector<Command> cmds = {Sequence(0x40, 3, 10), Command(0x41, 0), Sequence(0x42, TCPProtocol::kMaxBatchedArgs, 7)};
+    const Command batch = TCPProtocol::Batch(cmds);
+    EXPECT_EQ(batch.command, TCPProtocol::kBatch);
+    EXPECT_EQ(batch.arguments.size(), 3 + 3 + 0 + TCPProtocol::kMaxBatchedArgs);
+    EXPECT_EQ(batch.arguments[0], 0x40u | 3u << 16);
+
+    std::vector<Command> unbatched;
+    EXPECT_TRUE(TCPProtocol::Unbatch(batch, unbatched));
+    ASSERT_EQ(unbatched.size(), cmds.size());
+    for (size_t i = 0; i < cmds.size(); i++) {
+        EXPECT_EQ(unbatched[i].command, cmds[i].command);
+        EXPECT_EQ(unbatched[i].arguments, cmds[i].arguments);
+    }
+}
+
+// A full batch of the largest batched commands still fits in one frame
+TEST_F(TCPProtocolTest, BatchFitsInFrame) {
+    std::vector<Command> cmds(TCPProtocol::kMaxBatchCommands, Sequence(0x43, TCPProtocol::kMaxBatchedArgs));
+    EXPECT_LE(TCPProtocol::Batch(cmds).arguments.size(), TCPProtocol::kMaxFrameArgs);
+}
+
+TEST_F(TCPProtocolTest, UnbatchRejectsMalformed) {
+    std::vector<Command> cmds;
+    EXPECT_FALSE(TCPProtocol::Unbatch(Command(0x44, 2), cmds));
+
+    // An arg count running past the end of the batch
+    Command overrun = TCPProtocol::Batch({Sequence(0x44, 4)});
+    overrun.arguments.pop_back();
+    EXPECT_FALSE(TCPProtocol::Unbatch(overrun, cmds));
+
+    // Batches don't nest
+    const Command inner = TCPProtocol::Batch({Sequence(0x44, 2)});
+    EXPECT_FALSE(TCPProtocol::Unbatch(TCPProtocol::Batch({inner}), cmds));
+
+    cmds.clear();
+    EXPECT_TRUE(TCPProtocol::Unbatch(Command(TCPProtocol::kBatch, 0), cmds));
+    EXPECT_TRUE(cmds.empty());
+}
+
+TEST_F(TCPProtocolTest, CorrelateRoundTrip) {
+    for (const bool reply : {false, true}) {
+        Command envelope = TCPProtocol::Correlate(0xDEADBEEF, Sequence(0x50, 4, 1), reply);
+        EXPECT_EQ(envelope.command, reply ? TCPProtocol::kCorrelatedReply : TCPProtocol::kCorrelated);
+        EXPECT_EQ(envelope.arguments.size(), 6u);
+
+        uint32_t correlation_id = 0;
+        bool is_reply = !reply;
+        EXPECT_TRUE(TCPProtocol::Uncorrelate(envelope, correlation_id, is_reply));
+        EXPECT_EQ(correlation_id, 0xDEADBEEF);
+        EXPECT_EQ(is_reply, reply);
+        EXPECT_EQ(envelope.command, 0x50);
+        EXPECT_EQ(envelope.arguments, Sequence(0x50, 4, 1).arguments);
+    }
+    // Commands without args, as acks often are
+    Command envelope = TCPProtocol::Correlate(0, Command(0x51, 0));
+    uint32_t correlation_id = 1;
+    bool is_reply = true;
+    EXPECT_TRUE(TCPProtocol::Uncorrelate(envelope, correlation_id, is_reply));
+    EXPECT_EQ(correlation_id, 0u);
+    EXPECT_FALSE(is_reply);
+    EXPECT_TRUE(envelope.arguments.empty());
+}
+
+// Anything else is left as it is
+TEST_F(TCPProtocolTest, UncorrelateRejects) {
+    uint32_t correlation_id = 7;
+    bool is_reply = false;
+    Command plain = Sequence(0x52, 3);
+    EXPECT_FALSE(TCPProtocol::Uncorrelate(plain, correlation_id, is_reply));
+    EXPECT_EQ(plain.command, 0x52);
+    EXPECT_EQ(plain.arguments.size(), 3u);
+    Command short_envelope(TCPProtocol::kCorrelated, 1);
+    EXPECT_FALSE(TCPProtocol::Uncorrelate(short_envelope, correlation_id, is_reply));
+    EXPECT_EQ(correlation_id, 7u);
+}
@@ -0,0 +1,116 @@
+//
+// Unit tests for the token bucket traffic shaper.
+//
+
+#include "gtest/gtest.h"
+#include "../tcp_shaper.h"
+#include <chrono>
+#include <stdexcept>
+
+using Clock = TrafficShaper::Clock;
+using std::chrono::milliseconds;
+using std::chrono::microseconds;
+
+// ReadyAt rounds through a double, allow it a microsecond either way
+void ExpectNear(const Clock::time_point actual, const Clock::time_point expected) {
+    EXPECT_LE(actual - expected, microseconds(1));
+    EXPECT_LE(expected - actual, microseconds(1));
+}
+
+TEST(TrafficShaperTest, UnlimitedByDefault) {
+    TrafficShaper shaper;
+    const auto now = Clock::now();
+    EXPECT_FALSE(shaper.Enabled());
+    shaper.Consume(0, 1000000);
+    EXPECT_TRUE(shaper.Ready(0, now));
+    EXPECT_EQ(shaper.ReadyAt(0, now), now);
+}
+
+// A frame larger than the burst goes out and the bucket pays off the debt before the next one
+TEST(TrafficShaperTest, DebtDelaysNextFrame) {
+    TrafficShaper shaper;
+    shaper.SetLinkRate(1000, 100);
+    EXPECT_TRUE(shaper.Enabled());
+    const auto now = Clock::now();
+    EXPECT_TRUE(shaper.Ready(0, now));
+    shaper.Consume(0, 600);
+    EXPECT_FALSE(shaper.Ready(0, now));
+
+    const auto ready_at = shaper.ReadyAt(0, now);
+    ExpectNear(ready_at, now + milliseconds(500) + microseconds(1));
+    EXPECT_FALSE(shaper.Ready(0, now + milliseconds(499)));
+    EXPECT_TRUE(shaper.Ready(0, ready_at));
+}
+
+// Tokens stop accumulating at the burst, however long the link was idle
+TEST(TrafficShaperTest, RefillCappedAtBurst) {
+    TrafficShaper shaper;
+    shaper.SetLinkRate(1000, 100);
+    const auto later = Clock::now() + std::chrono::seconds(10);
+    EXPECT_TRUE(shaper.Ready(0, later));
+    shaper.Consume(0, 150);
+    EXPECT_FALSE(shaper.Ready(0, later));
+    ExpectNear(shaper.ReadyAt(0, later), later + milliseconds(50) + microseconds(1));
+}
+
+// A frame is held by whichever of its class and the link is further in debt
+TEST(TrafficShaperTest, ClassAndLinkBuckets) {
+    TrafficShaper shaper;
+    shaper.SetLinkRate(1000, 10);
+    shaper.SetClassRate(1, 100, 10);
+    const auto now = Clock::now();
+    EXPECT_TRUE(shaper.Ready(1, now));
+    EXPECT_TRUE(shaper.Ready(2, now));
+    shaper.Consume(1, 110);
+
+    ExpectNear(shaper.ReadyAt(1, now), now + milliseconds(1000) + microseconds(1));
+    ExpectNear(shaper.ReadyAt(2, now), now + milliseconds(100) + microseconds(1));
+    EXPECT_TRUE(shaper.Ready(2, now + milliseconds(101)));
+    EXPECT_FALSE(shaper.Ready(1, now + milliseconds(101)));
+}
+
+// Control frames are never held back but are charged to the link
+TEST(TrafficShaperTest, ControlClassNeverWaits) {
+    TrafficShaper shaper;
+    shaper.SetLinkRate(1000, 10);
+    const auto now = Clock::now();
+    shaper.Consume(TrafficShaper::kControlClass, 1010);
+    EXPECT_TRUE(shaper.Ready(TrafficShaper::kControlClass, now));
+    EXPECT_EQ(shaper.ReadyAt(TrafficShaper::kControlClass, now), now);
+    EXPECT_FALSE(shaper.Ready(0, now));
+    EXPECT_GT(shaper.ReadyAt(0, now), now + milliseconds(999));
+}
+
+// Shaping stays on while any rate is set and goes off with the last one
+TEST(TrafficShaperTest, DisabledOnceRatesRemoved) {
+    TrafficShaper shaper;
+    shaper.SetLinkRate(1000, 100);
+    shaper.SetClassRate(2, 100, 10);
+    shaper.SetLinkRate(0, 0);
+    EXPECT_TRUE(shaper.Enabled());
+    shaper.SetClassRate(2, 0, 0);
+    EXPECT_FALSE(shaper.Enabled());
+    shaper.SetClassRate(5, 100, 10);
+    EXPECT_TRUE(shaper.Enabled());
+}
+
+TEST(TrafficShaperTest, ClassOutOfRange) {
+    TrafficShaper shaper;
+    EXPECT_THROW(shaper.SetClassRate(TrafficShaper::kNumClasses, 1000, 100), std::out_of_range);
+}
+
+TEST(TrafficShaperTest, DelayStats) {
+    TrafficShaper shaper;
+    shaper.RecordDelay(3, Clock::duration::zero());
+    shaper.RecordDelay(3, milliseconds(2));
+    shaper.RecordDelay(3, milliseconds(4));
+    const TrafficShaper::Stats stats = shaper.GetStats(3);
+    EXPECT_EQ(stats.frames, 3u);
+    EXPECT_EQ(stats.delayed, 2u);
+    EXPECT_DOUBLE_EQ(stats.mean_delay_ms, 3.0);
+    EXPECT_DOUBLE_EQ(stats.max_delay_ms, 4.0);
+    EXPECT_EQ(shaper.GetStats(TrafficShaper::kControlClass).frames, 0u);
+    shaper.RecordDelay(TrafficShaper::kControlClass, Clock::duration::zero());
+    EXPECT_EQ(shaper.GetStats(TrafficShaper::kControlClass).frames, 1u);
+    EXPECT_EQ(shaper.GetStats(3).frames, 3u);
+}
@@ -0,0 +1,491 @@
+//
+// Unit tests for the simulated link, driving both ends of a connection on its virtual clock.
+//
+
+#include "gtest/gtest.h"
+#include "../tcp_connection.h"
+#include "../tcp_sim_transport.h"
+#include <chrono>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using std::chrono::milliseconds;
+
+class SimLinkTest : public ::testing::Test {
+protected:
+    static constexpr uint16_t kPort = 7000;
+    // Connection state changes seen by the client, in virtual ms
+    using Timeline = std::vector<std::pair<int64_t, bool>>;
+
+    // Both ends of "sim:<name>", each test uses its own name so the links don't carry over
+    void Open(const std::string &name, const bool use_heartbeat) {
+        link_ = SimLink::Open(name + "." + std::to_string(kPort));
+        link_->SetSeed(1);
+        server_ = std::make_shared<TCPConnection>(io_context_, "sim:" + name, kPort, true, use_heartbeat, false);
+        client_ = std::make_shared<TCPConnection>(io_context_, "sim:" + name, kPort, false, use_heartbeat, false);
+    }
+    void Start() {
+        server_->Start();
+        client_->Start();
+    }
+    void TearDown() override {
+        if (server_) server_->setStopCmdRead();
+        if (client_) client_->setStopCmdRead();
+        server_.reset();
+        client_.reset();
+    }
+
+    static int64_t Ms(const SimLink::Duration time) {
+        return std::chrono::duration_cast<milliseconds>(time).count();
+    }
+    // Advance in steps, noting when the client's side of the link goes down or comes up
+    void Record(Timeline &timeline, const milliseconds duration, const milliseconds step = milliseconds(100)) {
+        for (milliseconds elapsed(0); elapsed < duration; elapsed += step) {
+            link_->Advance(step);
+            const bool open = client_->getSocketIsOpen();
+            if (timeline.empty() || timeline.back().second != open) timeline.emplace_back(Ms(link_->Now()), open);
+        }
+    }
+    // A send callback which hands its result to the future
+    static SendCallback Recorder(std::future<asio::error_code> &result) {
+        auto promise = std::make_shared<std::promise<asio::error_code>>();
+        result = promise->get_future();
+        return [promise](const asio::error_code &ec) { promise->set_value(ec); };
+    }
+    static std::vector<uint16_t> Codes(const std::vector<Command> &cmds) {
+        std::vector<uint16_t> codes;
+        for (const Command &cmd : cmds) codes.push_back(cmd.command);
+        return codes;
+    }
+    static void ExpectSameStats(const SimLink::Stats &a, const SimLink::Stats &b) {
+        EXPECT_EQ(a.frames, b.frames);
+        EXPECT_EQ(a.bytes, b.bytes);
+        EXPECT_EQ(a.corrupted, b.corrupted);
+        EXPECT_EQ(a.truncated, b.truncated);
+        EXPECT_EQ(a.lost, b.lost);
+        EXPECT_EQ(a.disconnects, b.disconnects);
+        EXPECT_EQ(a.closed, b.closed);
+    }
+
+    asio::io_context io_context_;
+    std::shared_ptr<SimLink> link_;
+    std::shared_ptr<TCPConnection> server_;
+    std::shared_ptr<TCPConnection> client_;
+};
+
+// The server sends a heartbeat a second and the client acks each one, well within the read timeout
+TEST_F(SimLinkTest, HeartbeatsKeepLinkUp) {
+    SimLink::Impairments impairments{};
+    impairments.latency = milliseconds(100);
+    Open("heartbeat_up", true);
+    link_->SetImpairments(SimLink::kToServer, impairments);
+    link_->SetImpairments(SimLink::kToClient, impairments);
+    Start();
+
+    Timeline timeline;
+    Record(timeline, milliseconds(30500));
+    EXPECT_EQ(timeline, (Timeline{{100, true}}));
+    const SimLink::Stats stats = link_->GetStats();
+    EXPECT_EQ(stats.frames, 60u); // 30 heartbeats, 30 acks
+    EXPECT_EQ(stats.lost, 0u);
+    EXPECT_EQ(stats.closed, 0u);
+    EXPECT_EQ(stats.disconnects, 0u);
+    EXPECT_TRUE(server_->getSocketIsOpen());
+}
+
+// With the heartbeats lost the client's read times out and it reconnects, the server's read times out
+// in the next session as the client then has nothing to ack. Once the path recovers the link stays up
+TEST_F(SimLinkTest, HeartbeatTimeoutReconnects) {
+    auto run = [this](const std::string &name, Timeline &timeline, SimLink::Stats &stats) {
+        SimLink::Impairments impairments{};
+        impairments.latency = milliseconds(100);
+        Open(name, true);
+        link_->SetImpairments(SimLink::kToServer, impairments);
+        link_->SetImpairments(SimLink::kToClient, impairments);
+        Start();
+        Record(timeline, milliseconds(2500));
+        impairments.loss_rate = 1;
+        link_->SetImpairments(SimLink::kToClient, impairments);
+        Record(timeline, milliseconds(12500));
+        impairments.loss_rate = 0;
+        link_->SetImpairments(SimLink::kToClient, impairments);
+        Record(timeline, milliseconds(15000));
+        stats = link_->GetStats();
+        TearDown();
+    };
+    Timeline first;
+    SimLink::Stats first_stats{};
+    run("heartbeat_timeout_1", first, first_stats);
+    // Last heartbeat read at 2.1s, read timeout 5s, down for the 1s reconnect delay
+    EXPECT_EQ(first, (Timeline{{100, true}, {7100, false}, {8100, true}, {13100, false}, {14100, true}}));
+    EXPECT_EQ(first_stats.closed, 2u);
+    EXPECT_EQ(first_stats.disconnects, 0u);
+
+    Timeline second;
+    SimLink::Stats second_stats{};
+    run("heartbeat_timeout_2", second, second_stats);
+    EXPECT_EQ(first, second);
+    ExpectSameStats(first_stats, second_stats);
+}
+
+// A scheduled outage drops what is in flight, commands queued while the link is down are lost with
+// the send queue and the ends carry on once it is back
+TEST_F(SimLinkTest, OutageReconnects) {
+    SimLink::Impairments impairments{};
+    impairments.latency = milliseconds(100);
+    Open("outage", false);
+    link_->SetImpairments(SimLink::kToServer, impairments);
+    link_->SetImpairments(SimLink::kToClient, impairments);
+    link_->ScheduleDisconnect(milliseconds(3050), milliseconds(2000));
+    Start();
+
+    Timeline timeline;
+    Record(timeline, milliseconds(3000));
+    server_->WriteSendBuffer(Command(1, 1));
+    Record(timeline, milliseconds(3000));
+    server_->WriteSendBuffer(Command(2, 1));
+    Record(timeline, milliseconds(1000));
+    EXPECT_EQ(timeline, (Timeline{{100, true}, {3100, false}, {5100, true}}));
+
+    Command cmd(0, 0);
+    ASSERT_TRUE(client_->ReadRecvBuffer(cmd, milliseconds(0)));
+    EXPECT_EQ(cmd.command, 2);
+    EXPECT_FALSE(client_->ReadRecvBuffer(cmd, milliseconds(0)));
+    const SimLink::Stats stats = link_->GetStats();
+    EXPECT_EQ(stats.disconnects, 1u);
+    EXPECT_EQ(stats.closed, 0u);
+    EXPECT_EQ(stats.lost, 1u); // the first command, still in flight at 3.05s
+}
+
+// Impairments draw from the seeded generators, so a run with jitter, a slow link and bit errors
+// delivers the same commands at the same virtual times every time
+TEST_F(SimLinkTest, ImpairedRunIsReproducible) {
+    auto run = [this](const std::string &name, std::vector<int64_t> &arrivals, SimLink::Stats &stats) {
+        SimLink::Impairments impairments{};
+        impairments.latency = milliseconds(20);
+        impairments.jitter = milliseconds(5);
+        impairments.bytes_per_sec = 1e6;
+        impairments.bit_error_rate = 1e-5;
+        Open(name, false);
+        link_->SetImpairments(SimLink::kToClient, impairments);
+        // Inline handlers run on the client's receive thread, which the clock waits for
+        client_->RegisterHandler(1, [this, &arrivals](Command&) { arrivals.push_back(Ms(link_->Now())); }, true);
+        Start();
+        link_->Advance(milliseconds(1));
+        for (int i = 0; i < 200; i++) server_->WriteSendBuffer(Command(1, 64));
+        link_->Advance(milliseconds(1000));
+        stats = link_->GetStats();
+        TearDown();
+    };
+    std::vector<int64_t> first;
+    SimLink::Stats first_stats{};
+    run("reproducible_1", first, first_stats);
+    EXPECT_GT(first.size(), 100u);
+    EXPECT_GT(first_stats.corrupted, 0u);
+
+    std::vector<int64_t> second;
+    SimLink::Stats second_stats{};
+    run("reproducible_2", second, second_stats);
+    EXPECT_EQ(first, second);
+    ExpectSameStats(first_stats, second_stats);
+}
+
+// Each command of a batch is acked with the size of its own frame, not that of the batch
+TEST_F(SimLinkTest, BatchedCommandsAckedWithOwnSize) {
+    Open("batch_ack", false);
+    server_->SetCapabilities(TCPProtocol::kCapBatching);
+    client_->SetCapabilities(TCPProtocol::kCapBatching);
+    Start();
+    link_->Advance(milliseconds(1));
+    ASSERT_EQ(server_->GetPeerCapabilities(), TCPProtocol::kCapBatching);
+
+    // Queued under one lock, so the send thread finds them together and batches them
+    std::vector<Command> cmds{Command(1, 1), Command(2, 2), Command(3, 3)};
+    server_->WriteSendBuffer(cmds);
+    link_->Advance(milliseconds(10));
+    std::vector<Command> acks = server_->TryReadRecvBuffer(3);
+    ASSERT_EQ(acks.size(), 3u);
+    for (uint16_t i = 0; i < 3; i++) {
+        EXPECT_EQ(acks[i].command, i + 1);
+        ASSERT_EQ(acks[i].arguments.size(), 1u);
+        EXPECT_EQ(acks[i].arguments[0], TCPProtocol::header_size_ + 4u * (i + 1) + TCPProtocol::footer_size_);
+    }
+}
+
+// Without the extensions negotiated the envelope codes are ordinary commands, as a legacy peer may use them.
+// A client which doesn't advertise any capabilities never hears about the server's
+TEST_F(SimLinkTest, EnvelopeCodesDeliveredUntilNegotiated) {
+    Open("legacy", false);
+    server_->SetCapabilities(TCPProtocol::kCapCorrelation | TCPProtocol::kCapCompression |
+                             TCPProtocol::kCapFragmentation | TCPProtocol::kCapBatching);
+    Start();
+    link_->Advance(milliseconds(1));
+    EXPECT_EQ(server_->GetPeerCapabilities(), 0u);
+
+    const std::vector<uint16_t> codes{TCPProtocol::kBatch, TCPProtocol::kFragment, TCPProtocol::kCompressed,
+                                      TCPProtocol::kCorrelatedReply, TCPProtocol::kCorrelated, TCPProtocol::kCapabilities};
+    for (const uint16_t code : codes) server_->WriteSendBuffer(Command(code, 1));
+    link_->Advance(milliseconds(10));
+    std::vector<Command> received = client_->TryReadRecvBuffer(codes.size() + 1);
+    ASSERT_EQ(received.size(), codes.size());
+    for (size_t i = 0; i < codes.size(); i++) {
+        EXPECT_EQ(received[i].command, codes[i]);
+        EXPECT_EQ(received[i].arguments.size(), 1u);
+    }
+    std::vector<Command> acks = server_->TryReadRecvBuffer(codes.size() + 1);
+    ASSERT_EQ(acks.size(), codes.size());
+    for (size_t i = 0; i < codes.size(); i++) EXPECT_EQ(acks[i].command, codes[i]);
+}
+
+// A request sent in a correlation envelope is shaped in the class of its own code
+TEST_F(SimLinkTest, CorrelatedRequestKeepsTrafficClass) {
+    Open("request_class", false);
+    server_->SetCapabilities(TCPProtocol::kCapCorrelation);
+    client_->SetCapabilities(TCPProtocol::kCapCorrelation);
+    server_->SetTrafficClass(5, 1);
+    server_->SetClassRate(1, 1e6, 1e6);
+    Start();
+    link_->Advance(milliseconds(1));
+    ASSERT_EQ(server_->GetPeerCapabilities(), TCPProtocol::kCapCorrelation);
+
+    std::future<Command> ack = server_->SendRequest(Command(5, 1));
+    link_->Advance(milliseconds(10));
+    ASSERT_EQ(ack.wait_for(milliseconds(0)), std::future_status::ready);
+    EXPECT_EQ(ack.get().command, 5);
+    EXPECT_EQ(server_->GetShapingStats(1).frames, 1u);
+    EXPECT_EQ(server_->GetShapingStats(0).frames, 0u);
+    EXPECT_EQ(server_->GetShapingStats(TrafficShaper::kControlClass).frames, 1u); // the capabilities reply
+}
+
+// Correlated requests conflate and expire by their own code, not that of the envelope. The shaper holds
+// them back, its timer runs on the io context which the test never runs
+TEST_F(SimLinkTest, CorrelatedRequestsConflateAndExpireByCode) {
+    Open("request_conflation", false);
+    server_->SetCapabilities(TCPProtocol::kCapCorrelation);
+    client_->SetCapabilities(TCPProtocol::kCapCorrelation);
+    server_->SetClassRate(1, 1, 1);
+    for (const uint16_t code : {6, 7, 8}) server_->SetTrafficClass(code, 1);
+    server_->EnableConflation(6);
+    server_->SetMaxQueueAge(8, milliseconds(50));
+    Start();
+    link_->Advance(milliseconds(1));
+    server_->WriteSendBuffer(Command(7, 1)); // uses up the class' tokens
+    link_->Advance(milliseconds(10));
+
+    // Expiry is checked at the front of the queue, so the stale one goes first
+    std::future<Command> stale = server_->SendRequest(Command(8, 1));
+    std::future<Command> first = server_->SendRequest(Command(6, 1));
+    std::future<Command> second = server_->SendRequest(Command(6, 1));
+    link_->Advance(milliseconds(10));
+    std::this_thread::sleep_for(milliseconds(60));
+    server_->WriteSendBuffer(Command(9, 1)); // class 0, the send thread checks the held commands on the way
+    link_->Advance(milliseconds(10));
+
+    auto error_of = [](std::future<Command> &request) {
+        if (request.wait_for(milliseconds(0)) != std::future_status::ready) return asio::error_code();
+        try {
+            request.get();
+        } catch (const asio::system_error &e) {
+            return e.code();
+        }
+        return asio::error_code();
+    };
+    EXPECT_EQ(error_of(first), asio::error::operation_aborted);
+    EXPECT_EQ(second.wait_for(milliseconds(0)), std::future_status::timeout); // still held back
+    EXPECT_EQ(error_of(stale), asio::error::timed_out);
+    EXPECT_EQ(server_->GetConflatedCounts(), (std::map<uint16_t, uint64_t>{{6, 1}}));
+    EXPECT_EQ(server_->GetExpiredCounts(), (std::map<uint16_t, uint64_t>{{8, 1}}));
+    EXPECT_EQ(server_->GetShapingStats(1).queued, 1u);
+}
+
+// A command which outlives its queue age while the shaper holds it back is dropped, not sent late
+TEST_F(SimLinkTest, ExpiryWhileHeldByShaper) {
+    Open("shaped_expiry", false);
+    server_->SetClassRate(1, 1, 1);
+    server_->SetTrafficClass(5, 1);
+    server_->SetTrafficClass(7, 1);
+    server_->SetMaxQueueAge(5, milliseconds(50));
+    Start();
+    link_->Advance(milliseconds(1));
+    server_->WriteSendBuffer(Command(7, 1)); // uses up the class' tokens
+    link_->Advance(milliseconds(10));
+
+    std::future<asio::error_code> sent;
+    server_->WriteSendBuffer(Command(5, 1), Recorder(sent));
+    link_->Advance(milliseconds(10));
+    EXPECT_EQ(server_->GetShapingStats(1).queued, 1u);
+    std::this_thread::sleep_for(milliseconds(60)); // queue ages are on the wall clock
+    server_->WriteSendBuffer(Command(9, 1)); // class 0, the send thread checks the held commands on the way
+    link_->Advance(milliseconds(10));
+
+    ASSERT_EQ(sent.wait_for(milliseconds(0)), std::future_status::ready);
+    EXPECT_EQ(sent.get(), asio::error::timed_out);
+    EXPECT_EQ(server_->GetExpiredCounts(), (std::map<uint16_t, uint64_t>{{5, 1}}));
+    EXPECT_EQ(server_->GetShapingStats(1).queued, 0u);
+    EXPECT_EQ(Codes(client_->TryReadRecvBuffer(10)), (std::vector<uint16_t>{7, 9}));
+}
+
+// A conflated command held back by the shaper is replaced where it waits. The replaced one's callback
+// gets operation_aborted and only the latest value goes out once the class has tokens again
+TEST_F(SimLinkTest, ConflatedCommandReplacedWhileShaped) {
+    Open("shaped_conflation", false);
+    server_->SetClassRate(1, 1, 1);
+    server_->SetTrafficClass(5, 1);
+    server_->SetTrafficClass(7, 1);
+    server_->EnableConflation(5);
+    Start();
+    link_->Advance(milliseconds(1));
+    server_->WriteSendBuffer(Command(7, 1)); // uses up the class' tokens
+    link_->Advance(milliseconds(10));
+
+    std::future<asio::error_code> superseded;
+    Command older(5, 1);
+    older.arguments[0] = 1;
+    server_->WriteSendBuffer(std::move(older), Recorder(superseded));
+    link_->Advance(milliseconds(10));
+    ASSERT_EQ(server_->GetShapingStats(1).queued, 1u);
+
+    std::future<asio::error_code> latest;
+    Command newer(5, 1);
+    newer.arguments[0] = 2;
+    server_->WriteSendBuffer(std::move(newer), Recorder(latest));
+    link_->Advance(milliseconds(10));
+    ASSERT_EQ(superseded.wait_for(milliseconds(0)), std::future_status::ready);
+    EXPECT_EQ(superseded.get(), asio::error::operation_aborted);
+    EXPECT_EQ(latest.wait_for(milliseconds(0)), std::future_status::timeout);
+    EXPECT_EQ(server_->GetConflatedCounts(), (std::map<uint16_t, uint64_t>{{5, 1}}));
+    EXPECT_EQ(server_->GetShapingStats(1).queued, 1u);
+
+    // The bucket starts full again and the send thread looks at the held command
+    server_->SetClassRate(1, 1e6, 1e6);
+    server_->WriteSendBuffer(Command(9, 1));
+    link_->Advance(milliseconds(10));
+    ASSERT_EQ(latest.wait_for(milliseconds(0)), std::future_status::ready);
+    EXPECT_FALSE(latest.get());
+    const std::vector<Command> received = client_->TryReadRecvBuffer(10);
+    ASSERT_EQ(Codes(received), (std::vector<uint16_t>{7, 5, 9}));
+    EXPECT_EQ(received[1].arguments, std::vector<uint32_t>{2});
+}
+
+// Inline handlers run as the frame is decoded and never reach the receive buffer, the others run in
+// DispatchRecvBuffer() and codes without a handler come back from it in arrival order
+TEST_F(SimLinkTest, HandlersDispatchByCode) {
+    Open("handlers", false);
+    // Inline handlers run on the client's receive thread, which the clock waits for
+    std::vector<uint32_t> handled_inline;
+    std::vector<uint32_t> dispatched;
+    client_->RegisterHandler(1, [&handled_inline](Command &cmd) { handled_inline.push_back(cmd.arguments[0]); }, true);
+    client_->RegisterHandler(2, [](Command &) { ADD_FAILURE() << "Replaced handler called"; });
+    client_->RegisterHandler(2, [&dispatched](Command &cmd) { dispatched.push_back(cmd.arguments[0]); });
+    Start();
+    link_->Advance(milliseconds(1));
+    for (uint32_t i = 0; i < 6; i++) {
+        Command cmd(static_cast<uint16_t>(i % 3 + 1), 1);
+        cmd.arguments[0] = i;
+        server_->WriteSendBuffer(std::move(cmd));
+    }
+    link_->Advance(milliseconds(10));
+    EXPECT_EQ(handled_inline, (std::vector<uint32_t>{0, 3}));
+    EXPECT_TRUE(dispatched.empty());
+
+    const std::vector<Command> unhandled = client_->DispatchRecvBuffer();
+    EXPECT_EQ(dispatched, (std::vector<uint32_t>{1, 4}));
+    ASSERT_EQ(Codes(unhandled), (std::vector<uint16_t>{3, 3}));
+    EXPECT_EQ(unhandled[0].arguments[0], 2u);
+    EXPECT_EQ(unhandled[1].arguments[0], 5u);
+    // Handled or not, every command is acked
+    EXPECT_EQ(Codes(server_->TryReadRecvBuffer(10)), (std::vector<uint16_t>{1, 2, 3, 1, 2, 3}));
+}
+
+// Frames of a latest value code overwrite its slot and aren't queued, one too large for the slot is
+TEST_F(SimLinkTest, LatestValueKeepsNewestFrame) {
+    Open("latest_value", false);
+    client_->EnableLatestValue(4, 2);
+    Start();
+    link_->Advance(milliseconds(1));
+    Command latest(0, 0);
+    EXPECT_EQ(client_->ReadLatest(4, latest), 0u);
+    EXPECT_EQ(client_->ReadLatest(5, latest), 0u);
+
+    for (uint32_t i = 1; i <= 3; i++) {
+        Command cmd(4, i % 2 + 1); // the length varies within the slot
+        for (auto &arg : cmd.arguments) arg = i;
+        server_->WriteSendBuffer(std::move(cmd));
+    }
+    link_->Advance(milliseconds(10));
+    EXPECT_EQ(client_->ReadLatest(4, latest), 3u);
+    EXPECT_EQ(latest.command, 4);
+    EXPECT_EQ(latest.arguments, (std::vector<uint32_t>{3, 3}));
+    EXPECT_TRUE(client_->TryReadRecvBuffer(10).empty());
+
+    server_->WriteSendBuffer(Command(4, 3));
+    link_->Advance(milliseconds(10));
+    EXPECT_EQ(client_->ReadLatest(4, latest), 3u);
+    EXPECT_EQ(latest.arguments, (std::vector<uint32_t>{3, 3}));
+    const std::vector<Command> queued = client_->TryReadRecvBuffer(10);
+    ASSERT_EQ(Codes(queued), std::vector<uint16_t>{4});
+    EXPECT_EQ(queued[0].arguments.size(), 3u);
+}
+
+// A broadcast goes out as the same frame on every connection, in its place in each send queue. Links
+// which batch and compress get it intact, it bypasses both
+TEST_F(SimLinkTest, BroadcastReachesEveryConnection) {
+    const uint32_t capabilities = TCPProtocol::kCapBatching | TCPProtocol::kCapCompression;
+    Open("broadcast_1", false);
+    std::shared_ptr<SimLink> other_link = SimLink::Open("broadcast_2." + std::to_string(kPort));
+    auto other_server = std::make_shared<TCPConnection>(io_context_, "sim:broadcast_2", kPort, true, false, false);
+    auto other_client = std::make_shared<TCPConnection>(io_context_, "sim:broadcast_2", kPort, false, false, false);
+    for (const auto &connection : {server_, client_, other_server, other_client}) {
+        connection->SetCapabilities(capabilities);
+        connection->EnableCompression(2);
+    }
+    Start();
+    other_server->Start();
+    other_client->Start();
+    link_->Advance(milliseconds(1));
+    other_link->Advance(milliseconds(1));
+
+    Command broadcast(2, 3);
+    broadcast.arguments = {7, 8, 9};
+    for (const auto &connection : {server_, other_server}) connection->WriteSendBuffer(Command(1, 1));
+    TCPConnection::Broadcast(broadcast, {server_, other_server});
+    for (const auto &connection : {server_, other_server}) connection->WriteSendBuffer(Command(3, 1));
+    link_->Advance(milliseconds(10));
+    other_link->Advance(milliseconds(10));
+
+    for (const auto &connection : {client_, other_client}) {
+        const std::vector<Command> received = connection->TryReadRecvBuffer(10);
+        ASSERT_EQ(Codes(received), (std::vector<uint16_t>{1, 2, 3}));
+        EXPECT_EQ(received[1].arguments, broadcast.arguments);
+    }
+    other_server->setStopCmdRead();
+    other_client->setStopCmdRead();
+}
+
+// Removing the last rate turns shaping off, the commands it held back go out straight away
+TEST_F(SimLinkTest, RemovingRatesReleasesHeldCommands) {
+    Open("shaping_off", false);
+    server_->SetClassRate(1, 1, 1);
+    server_->SetTrafficClass(5, 1);
+    Start();
+    link_->Advance(milliseconds(1));
+    server_->WriteSendBuffer(Command(5, 1)); // uses up the class' tokens
+    server_->WriteSendBuffer(Command(5, 2));
+    link_->Advance(milliseconds(10));
+    EXPECT_EQ(server_->GetShapingStats(1).queued, 1u);
+
+    server_->SetClassRate(1, 0, 0);
+    link_->Advance(milliseconds(10));
+    EXPECT_EQ(server_->GetShapingStats(1).queued, 0u);
+    server_->WriteSendBuffer(Command(6, 1));
+    link_->Advance(milliseconds(10));
+    const std::vector<Command> received = client_->TryReadRecvBuffer(10);
+    ASSERT_EQ(Codes(received), (std::vector<uint16_t>{5, 5, 6}));
+    EXPECT_EQ(received[1].arguments.size(), 2u);
+    EXPECT_THROW(server_->GetShapingStats(TrafficShaper::kControlClass + 1), std::out_of_range);
+}
@@ -0,0 +1,123 @@
+//
+// Unit tests for the subscription rings.
+//
+
+#include "gtest/gtest.h"
+#include "../tcp_subscription.h"
+#include <chrono>
+#include <memory>
+#include <thread>
+
+using std::chrono::milliseconds;
+
+class SubscriptionTest : public ::testing::Test {
+protected:
+    // Push a command with one arg, as the connection's receive thread does
+    static bool Push(Subscription &subscription, const uint32_t value, const uint16_t cmd = 1) {
+        auto command = std::make_shared<Command>(cmd, 1);
+        command->arguments[0] = value;
+        return subscription.Push(command);
+    }
+    static bool Matches(const Subscription &subscription, const Command &cmd) { return subscription.Matches(cmd); }
+};
+
+TEST_F(SubscriptionTest, ReadsInOrder) {
+    Subscription subscription(1, 1, nullptr, 8);
+    EXPECT_EQ(subscription.TryRead(), nullptr);
+    for (uint32_t i = 0; i < 20; i++) {
+        EXPECT_TRUE(Push(subscription, i));
+        EXPECT_TRUE(Push(subscription, i + 100));
+        EXPECT_EQ(subscription.Size(), 2u);
+        EXPECT_EQ(subscription.TryRead()->arguments[0], i);
+        EXPECT_EQ(subscription.Read(milliseconds(0))->arguments[0], i + 100);
+    }
+    EXPECT_EQ(subscription.Size(), 0u);
+}
+
+// A full ring drops and counts what doesn't fit, and takes commands again once read from
+TEST_F(SubscriptionTest, FullRingDrops) {
+    Subscription subscription(1, 1, nullptr, 3); // rounded up to 4
+    for (uint32_t i = 0; i < 4; i++) EXPECT_TRUE(Push(subscription, i));
+    EXPECT_FALSE(Push(subscription, 4));
+    EXPECT_FALSE(Push(subscription, 5));
+    EXPECT_EQ(subscription.GetDropped(), 2u);
+    EXPECT_EQ(subscription.Size(), 4u);
+
+    EXPECT_EQ(subscription.TryRead()->arguments[0], 0u);
+    EXPECT_TRUE(Push(subscription, 6));
+    for (const uint32_t expected : {1u, 2u, 3u, 6u}) EXPECT_EQ(subscription.TryRead()->arguments[0], expected);
+    EXPECT_EQ(subscription.TryRead(), nullptr);
+    EXPECT_EQ(subscription.GetDropped(), 2u);
+}
+
+TEST_F(SubscriptionTest, ReadTimesOut) {
+    Subscription subscription(1, 1, nullptr, 4);
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(subscription.Read(milliseconds(20)), nullptr);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, milliseconds(20));
+}
+
+// Close wakes a blocked reader, what is left in the ring can still be read
+TEST_F(SubscriptionTest, CloseWakesReader) {
+    Subscription subscription(1, 1, nullptr, 4);
+    std::thread closer([&subscription] {
+        std::this_thread::sleep_for(milliseconds(20));
+        subscription.Close();
+    });
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(subscription.Read(milliseconds(10000)), nullptr);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, milliseconds(5000));
+    closer.join();
+    EXPECT_TRUE(subscription.IsClosed());
+
+    Subscription drained(1, 1, nullptr, 4);
+    EXPECT_TRUE(Push(drained, 7));
+    drained.Close();
+    EXPECT_EQ(drained.Read(milliseconds(10000))->arguments[0], 7u);
+    EXPECT_EQ(drained.Read(milliseconds(10000)), nullptr);
+}
+
+// The longest timeout waits for ever rather than overflowing into one which has already passed
+TEST_F(SubscriptionTest, ReadWithoutTimeout) {
+    Subscription subscription(1, 1, nullptr, 4);
+    std::thread pusher([&subscription] {
+        std::this_thread::sleep_for(milliseconds(20));
+        Push(subscription, 3);
+        std::this_thread::sleep_for(milliseconds(20));
+        subscription.Close();
+    });
+    const Subscription::Ptr cmd = subscription.Read(milliseconds::max());
+    ASSERT_NE(cmd, nullptr);
+    EXPECT_EQ(cmd->arguments[0], 3u);
+    EXPECT_EQ(subscription.Read(milliseconds::max()), nullptr);
+    pusher.join();
+}
+
+// A push from another thread wakes a blocked reader, every command arrives once and in order
+TEST_F(SubscriptionTest, PushWakesReader) {
+    Subscription subscription(1, 1, nullptr, 16);
+    constexpr uint32_t kCount = 10000;
+    std::thread producer([&subscription] {
+        for (uint32_t i = 0; i < kCount; i++) {
+            while (!Push(subscription, i)) std::this_thread::yield();
+        }
+    });
+    for (uint32_t i = 0; i < kCount; i++) {
+        const Subscription::Ptr cmd = subscription.Read(milliseconds(10000));
+        ASSERT_NE(cmd, nullptr);
+        EXPECT_EQ(cmd->arguments[0], i);
+    }
+    producer.join();
+}
+
+TEST_F(SubscriptionTest, MatchesRangeAndPredicate) {
+    Subscription range(10, 20, nullptr, 4);
+    EXPECT_FALSE(Matches(range, Command(9, 0)));
+    EXPECT_TRUE(Matches(range, Command(10, 0)));
+    EXPECT_TRUE(Matches(range, Command(20, 0)));
+    EXPECT_FALSE(Matches(range, Command(21, 0)));
+
+    Subscription filtered(0, UINT16_MAX, [](const Command &cmd) { return !cmd.arguments.empty(); }, 4);
+    EXPECT_FALSE(Matches(filtered, Command(5, 0)));
+    EXPECT_TRUE(Matches(filtered, Command(5, 1)));
+}